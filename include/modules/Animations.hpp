@@ -220,8 +220,13 @@ glm::mat4 AnimBlender::Sample(std::vector<AnimTrack *> *AT) {
 
 void Animations::init(AssetFile &A) {
 	AF = &A;
+	// keeps the asset alive while the animations (and the skeletal
+	// animations built on them) use its model
+	if(AF->registry != nullptr) {
+		AF->registry->retain(AF);
+	}
 	
-	if(A.getType() != GLTF) {
+	if((A.getType() != GLTF) && (A.getType() != MGCG)) {
 		std::cout << "Error: Animations supported only in GLTF assets\n";
 		exit(0);
 	}
@@ -341,6 +346,9 @@ void Animations::cleanup() {
 	for(auto &a : GLTFanims) {
 		delete a.second;
 	}
+	if(AF->registry != nullptr) {
+		AF->registry->release(AF);
+	}
 }
 
 void SkeletalAnimation::init(Animations *_anims, int _NAnims, std::string BaseTrackName, int SkinId) 
@@ -47,8 +47,89 @@ struct TechniqueInstances {
 	int InstanceCount;
 	
 	TechniqueRef *T;
+	// SharedSet[pass][set] is true for the sets shared by all instances
+	bool **SharedSet;
 } ;
 
+// Vertex and index buffer shared by all the models with the same vertex format
+struct SceneGeometry {
+	VertexDescriptor *VD;
+	VkBuffer vertexBuffer;
+	GPUAllocation vertexBufferMemory;
+	VkBuffer indexBuffer;
+	GPUAllocation indexBufferMemory;
+} ;
+
+// Position of a model inside its SceneGeometry
+struct SceneMeshRange {
+	int geometry;
+	uint32_t firstIndex;
+	int32_t vertexOffset;
+} ;
+
+
+// Bump allocator for the tables of a Scene: everything is carved out of
+// large chunks and released at once. Memory is returned zeroed, like calloc.
+// Objects built with make() are destroyed by reset() in reverse order.
+struct SceneArena {
+	static const size_t chunkSize = 64 * 1024;
+	
+	struct Chunk {
+		char *data;
+		size_t size;
+	};
+	std::vector<Chunk> chunks;
+	int currentChunk = 0;
+	size_t chunkUsed = 0;
+	size_t bytesUsed = 0;
+	std::vector<std::pair<void *, void (*)(void *)>> destructors;
+	
+	void *allocate(size_t size, size_t alignment);
+	// empties the arena, keeping the chunks for the next allocations
+	void reset();
+	// empties the arena and frees the chunks
+	void release();
+	
+	template <class T>
+	T *alloc(size_t count) {
+		return static_cast<T *>(allocate(count * sizeof(T), alignof(T)));
+	}
+	template <class T, class... Args>
+	T *make(Args&&... args) {
+		T *obj = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if(!std::is_trivially_destructible<T>::value) {
+			destructors.push_back({obj, [](void *p) {static_cast<T *>(p)->~T();}});
+		}
+		return obj;
+	}
+};
+
+// Threads kept alive between the recordings of the command buffers.
+// run(count, job) calls job(0) ... job(count - 1) on the workers and on the
+// calling thread, and returns when all of them are done, rethrowing the
+// first exception.
+struct SceneWorkerPool {
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+	const std::function<void(int)> *job = nullptr;
+	int jobCount = 0;
+	int nextJob = 0;
+	int pending = 0;
+	bool stopping = false;
+	std::exception_ptr error = nullptr;
+	
+	void start(int nThreads);
+	void run(int count, const std::function<void(int)> &f);
+	void stop();
+	
+	private:
+	void workerLoop();
+	// takes the next job with the lock held, -1 if there are none
+	int takeJob();
+	void execute(int j, std::unique_lock<std::mutex> &guard);
+};
 
 class Scene {
 	public:
@@ -66,6 +147,12 @@ class Scene {
 	int ModelCount = 0;
 	Model **M;
 	std::unordered_map<std::string, int> MeshIds;
+	
+	// When set before init(), the models sharing a vertex format are packed
+	// in a single vertex and index buffer, bound once for each technique
+	bool mergeGeometry = false;
+	std::vector<SceneGeometry> Geometry;
+	std::vector<SceneMeshRange> MeshRanges;
 
 	// Textures
 	int TextureCount = 0;
@@ -85,14 +172,61 @@ class Scene {
 	TechniqueInstances *TI;
 	std::unordered_map<std::string, VertexDescriptor *> VDIds;
 	int Npasses;
+	
+	// Sets with one of these layouts (listed before init()) are allocated
+	// once and shared by all the instances, and are bound once per technique.
+	// They can only use textures defined by the technique, and all the
+	// techniques using the same layout must define the same textures.
+	std::vector<DescriptorSetLayout *> SharedDSLs;
+	std::unordered_map<DescriptorSetLayout *, DescriptorSet *> SharedDS;
+	std::unordered_map<DescriptorSetLayout *, std::vector<VkDescriptorImageInfo>> SharedTids;
+	
+	// Parallel recording of the draw calls in secondary command buffers.
+	// Techniques with many instances are split in ranges of at least
+	// minDrawsPerThread instances; each range is recorded in its own buffer,
+	// and range i of a frame uses a buffer of the pool i % recordingThreads.
+	int recordingThreads = 0;
+	// Threads decoding asset files, models and textures in init()
+	// (0 = one per core, 1 = no worker threads)
+	int loadingThreads = 0;
+	// When set before init(), prints the meshes, skins and animations
+	// of the glTF asset files
+	bool printAssetInfo = false;
+	int minDrawsPerThread = 64;
+	std::vector<VkCommandPool> threadPools;
+	// started by the first parallel recording, stopped by localCleanup()
+	SceneWorkerPool recordingWorkers;
+	// buffers of each pass, swap chain image and pool, allocated when needed
+	std::vector<std::vector<VkCommandBuffer>> secondaryCBs;
+	int secondaryImages = 0;
+	
+	// Arena holds everything created by init() (instances are stored
+	// contiguously, technique after technique), and it is released by
+	// localCleanup(). DSArena holds the descriptor sets, rebuilt with the
+	// swap chain.
+	SceneArena Arena;
+	SceneArena DSArena;
 
 
 	int init(BaseProject *_BP,  int _Npasses, std::vector<VertexDescriptorRef>  &VDRs, std::vector<TechniqueRef> &PRs, std::string file);
+	DescriptorSet *getSharedDescriptorSet(DescriptorSetLayout *DSL);
 
 	void pipelinesAndDescriptorSetsInit();
 	void pipelinesAndDescriptorSetsCleanup();
 	void localCleanup();
     void populateCommandBuffer(VkCommandBuffer commandBuffer, int passId, int currentImage);
+    void populateCommandBuffer(VkCommandBuffer commandBuffer, int passId, int currentImage, RenderPass *RP);
+    
+    private:
+	void recordTechnique(VkCommandBuffer commandBuffer, int passId, int currentImage, int k,
+						 int first, int last, int profScope);
+	void createMergedGeometry();
+	void createGeometryBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+							  VkBuffer &buffer, GPUAllocation &memory);
+	void cleanupMergedGeometry();
+	void createSecondaryCommandBuffers(int nImages);
+	void cleanupSecondaryCommandBuffers();
+	void runLoadingJobs(std::vector<std::function<void()>> &jobs);
 };
 
 #ifdef SCENE_IMPLEMENTATION
@@ -109,6 +243,127 @@ void VertexDescriptorRef::init(const char *_id, VertexDescriptor * _VD) {
 	VD = _VD;
 }
 
+void *SceneArena::allocate(size_t size, size_t alignment) {
+	size_t offset = (chunkUsed + alignment - 1) & ~(alignment - 1);
+	while((currentChunk >= chunks.size()) ||
+		  (offset + size > chunks[currentChunk].size)) {
+		if(currentChunk < chunks.size()) {
+			currentChunk++;
+			chunkUsed = 0;
+			offset = 0;
+			continue;
+		}
+		Chunk C;
+		// larger requests get a chunk of their own size
+		C.size = chunkSize;
+		if(size > C.size) {
+			C.size = size;
+		}
+		C.data = static_cast<char *>(malloc(C.size));
+		if(C.data == nullptr) {
+			throw std::runtime_error("failed to allocate scene arena chunk!");
+		}
+		chunks.push_back(C);
+	}
+	void *ptr = chunks[currentChunk].data + offset;
+	memset(ptr, 0, size);
+	chunkUsed = offset + size;
+	bytesUsed += size;
+	return ptr;
+}
+
+void SceneArena::reset() {
+	for(int i = destructors.size() - 1; i >= 0; i--) {
+		destructors[i].second(destructors[i].first);
+	}
+	destructors.clear();
+	currentChunk = 0;
+	chunkUsed = 0;
+	bytesUsed = 0;
+}
+
+void SceneArena::release() {
+	reset();
+	for(Chunk &C : chunks) {
+		free(C.data);
+	}
+	chunks.clear();
+}
+
+void SceneWorkerPool::start(int nThreads) {
+	stopping = false;
+	for(int t = 0; t < nThreads; t++) {
+		threads.emplace_back(&SceneWorkerPool::workerLoop, this);
+	}
+}
+
+void SceneWorkerPool::stop() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for(auto &t : threads) {
+		t.join();
+	}
+	threads.clear();
+}
+
+int SceneWorkerPool::takeJob() {
+	return (job != nullptr) && (nextJob < jobCount) ? nextJob++ : -1;
+}
+
+void SceneWorkerPool::execute(int j, std::unique_lock<std::mutex> &guard) {
+	guard.unlock();
+	std::exception_ptr failure = nullptr;
+	try {
+		(*job)(j);
+	} catch(...) {
+		failure = std::current_exception();
+	}
+	guard.lock();
+	if((failure != nullptr) && (error == nullptr)) {
+		error = failure;
+	}
+	if(--pending == 0) {
+		done.notify_all();
+	}
+}
+
+void SceneWorkerPool::workerLoop() {
+	std::unique_lock<std::mutex> guard(lock);
+	while(true) {
+		wake.wait(guard, [this]() {return stopping || ((job != nullptr) && (nextJob < jobCount));});
+		if(stopping) {
+			return;
+		}
+		int j = takeJob();
+		if(j >= 0) {
+			execute(j, guard);
+		}
+	}
+}
+
+void SceneWorkerPool::run(int count, const std::function<void(int)> &f) {
+	std::unique_lock<std::mutex> guard(lock);
+	job = &f;
+	jobCount = count;
+	nextJob = 0;
+	pending = count;
+	error = nullptr;
+	wake.notify_all();
+	
+	// the calling thread works too
+	for(int j = takeJob(); j >= 0; j = takeJob()) {
+		execute(j, guard);
+	}
+	done.wait(guard, [this]() {return pending == 0;});
+	job = nullptr;
+	if(error != nullptr) {
+		std::rethrow_exception(error);
+	}
+}
+
 int Scene::init(BaseProject *_BP,  int _Npasses, std::vector<VertexDescriptorRef>  &VDRs,  
 		  std::vector<TechniqueRef> &PRs, std::string file) {
 	BP = _BP;
@@ -138,48 +393,75 @@ int Scene::init(BaseProject *_BP,  int _Npasses, std::vector<VertexDescriptorRef
 		ifs.close();
 		std::cout << "\nScene contains " << js.size() << " definitions sections\n\n";
 		
+		// Loading runs in two steps: files are read, decoded and parsed by
+		// worker threads, then the GPU resources are created in order on this
+		// thread. Asset files and textures are independent, models extracted
+		// from asset files wait for them.
+		std::vector<std::function<void()>> jobs;
+		
 		// ASSET FILES
 		nlohmann::json afs = js["assetfiles"];
 		AssetFileCount = afs.size();
 		std::cout << "Asset Files count: " << AssetFileCount << "\n";
 
-		As = (AssetFile **)calloc(AssetFileCount, sizeof(AssetFile *));
+		As = Arena.alloc<AssetFile *>(AssetFileCount);
 		for(int k = 0; k < AssetFileCount; k++) {
 			AsIds[afs[k]["id"]] = k;
 			std::string MT = afs[k]["format"].template get<std::string>();
+			std::string path = afs[k]["file"];
 
-			As[k] = new AssetFile();
-			As[k]->init(afs[k]["file"], (MT[0] == 'O') ? OBJ : ((MT[0] == 'G') ? GLTF : MGCG));
-			if (MT[0] == 'G') {
-				// Solo se è un GLTF
-				tinygltf::TinyGLTF loader;
-				tinygltf::Model model;
-				std::string warn, err;
-				std::string path = afs[k]["file"];
-
-				bool ok = loader.LoadASCIIFromFile(&model, &warn, &err, path);
-				if (!ok) {
-					std::cerr << "Failed to load GLTF file for debug: " << path << "\n";
-					std::cerr << "Error: " << err << "\n";
-				} else {
-					std::cout << "\n=== DEBUG INFO FROM: " << path << " ===\n";
+			jobs.push_back([this, k, MT, path]() {
+				// shared with the models and animations using the same file
+				As[k] = BP->assetRegistry.acquire(path, (MT[0] == 'O') ? OBJ : ((MT[0] == 'G') ? GLTF : MGCG));
+				if (printAssetInfo && (MT[0] == 'G')) {
+					// Solo se è un GLTF
+					tinygltf::Model &model = *As[k]->getGLTFmodel();
+					std::ostringstream info;
+					info << "\n=== DEBUG INFO FROM: " << path << " ===\n";
 					for (size_t m = 0; m < model.meshes.size(); ++m) {
 						const auto& mesh = model.meshes[m];
-						std::cout << "Mesh " << m << ": " << mesh.name << "\n";
+						info << "Mesh " << m << ": " << mesh.name << "\n";
 						for (size_t p = 0; p < mesh.primitives.size(); ++p) {
 							const auto& prim = mesh.primitives[p];
-							std::cout << "  Primitive " << p << ":\n";
+							info << "  Primitive " << p << ":\n";
 							for (const auto& attr : prim.attributes) {
-								std::cout << "    Attribute: " << attr.first << "\n";
+								info << "    Attribute: " << attr.first << "\n";
 							}
 						}
 					}
-					std::cout << "Skins: " << model.skins.size() << "\n";
-					std::cout << "Animations: " << model.animations.size() << "\n";
-					std::cout << "===============================\n";
+					info << "Skins: " << model.skins.size() << "\n";
+					info << "Animations: " << model.animations.size() << "\n";
+					info << "===============================\n";
+					std::cout << info.str();
 				}
-			}
+			});
+		}
+		
+		// TEXTURES
+		nlohmann::json ts = js["textures"];
+		TextureCount = ts.size();
+		std::cout << "Textures count: " << TextureCount << "\n";
+
+		T = Arena.alloc<Texture *>(TextureCount);
+		std::vector<VkFormat> TFmt(TextureCount, VK_FORMAT_UNDEFINED);
+		for(int k = 0; k < TextureCount; k++) {
+			TextureIds[ts[k]["id"]] = k;
+			std::string TT = ts[k]["format"].template get<std::string>();
 
+			T[k] = Arena.make<Texture>();
+			if(TT[0] == 'C') {
+				TFmt[k] = VK_FORMAT_R8G8B8A8_SRGB;
+			} else if(TT[0] == 'D') {
+				TFmt[k] = VK_FORMAT_R8G8B8A8_UNORM;
+			} else {
+				std::cout << "FORMAT UNKNOWN: " << TT << "\n";
+				continue;
+			}
+			std::string file = ts[k]["texture"];
+			jobs.push_back([this, k, file]() {
+				T[k]->loadImages({file});
+			});
+std::cout << ts[k]["id"] << "(" << k << ") " << TT << "\n";
 		}
 		
 		// MODELS
@@ -187,51 +469,67 @@ int Scene::init(BaseProject *_BP,  int _Npasses, std::vector<VertexDescriptorRef
 		ModelCount = ms.size();
 		std::cout << "Models count: " << ModelCount << "\n";
 
-		M = (Model **)calloc(ModelCount, sizeof(Model *));
+		M = Arena.alloc<Model *>(ModelCount);
+		std::vector<std::function<void()>> assetJobs;
 		for(int k = 0; k < ModelCount; k++) {
 			MeshIds[ms[k]["id"]] = k;
 			std::string MT = ms[k]["format"].template get<std::string>();
 			std::string VDN = ms[k]["VD"].template get<std::string>();
+			VertexDescriptor *VD = VDIds[VDN];
 
-			M[k] = new Model();
+			M[k] = Arena.make<Model>();
+			M[k]->ownBuffers = !mergeGeometry;
 			if(MT[0] == 'A') {
 				// init from asset file
 				std::string AN = ms[k]["asset"].template get<std::string>();
 //std::cout << "Getting from asset: '" << AN << "'\n";
 				int aId = AsIds[AN];
 //std::cout << "aId " << aId << "\n";
-				M[k]->initFromAsset(BP, VDIds[VDN], As[aId], ms[k]["model"], ms[k]["meshId"], ms[k]["node"]);
+				std::string model = ms[k]["model"];
+				int meshId = ms[k]["meshId"];
+				std::string node = ms[k]["node"];
+				assetJobs.push_back([this, k, VD, aId, model, meshId, node]() {
+					M[k]->loadFromAsset(BP, VD, As[aId], model, meshId, node);
+				});
 			} else {
-				M[k]->init(BP, VDIds[VDN], ms[k]["model"], (MT[0] == 'O') ? OBJ : ((MT[0] == 'G') ? GLTF : MGCG));
+				std::string file = ms[k]["model"];
+				ModelType type = (MT[0] == 'O') ? OBJ : ((MT[0] == 'G') ? GLTF : MGCG);
+				jobs.push_back([this, k, VD, file, type]() {
+					M[k]->load(BP, VD, file, type);
+				});
 			}
 		}
 		
-		// TEXTURES
-		nlohmann::json ts = js["textures"];
-		TextureCount = ts.size();
-		std::cout << "Textures count: " << TextureCount << "\n";
-
-		T = (Texture **)calloc(TextureCount, sizeof(Texture *));
+		runLoadingJobs(jobs);
+		runLoadingJobs(assetJobs);
+		
+		// all the meshes are copied to the GPU with a single submission
+		BP->stagingUploader.beginBatch();
+		for(int k = 0; k < ModelCount; k++) {
+			M[k]->upload();
+		}
+		if(mergeGeometry) {
+			createMergedGeometry();
+		}
+		BP->stagingUploader.endBatch();
+		
 		for(int k = 0; k < TextureCount; k++) {
-			TextureIds[ts[k]["id"]] = k;
-			std::string TT = ts[k]["format"].template get<std::string>();
-
-			T[k] = new Texture();
-			if(TT[0] == 'C') {
-				T[k]->init(BP, ts[k]["texture"]);
-			} else if(TT[0] == 'D') {
-				T[k]->init(BP, ts[k]["texture"], VK_FORMAT_R8G8B8A8_UNORM);
-			} else {
-				std::cout << "FORMAT UNKNOWN: " << TT << "\n";
+			if(TFmt[k] != VK_FORMAT_UNDEFINED) {
+				T[k]->initFromImages(BP, TFmt[k]);
 			}
-std::cout << ts[k]["id"] << "(" << k << ") " << TT << "\n";
 		}
 
 		// INSTANCES TextureCount
 		nlohmann::json pis = js["instances"];
 		TechniqueInstanceCount = pis.size();
 std::cout << "Technique Instances count: " << TechniqueInstanceCount << "\n";
-		TI = (TechniqueInstances *)calloc(TechniqueInstanceCount, sizeof(TechniqueInstances));
+		TI = Arena.alloc<TechniqueInstances>(TechniqueInstanceCount);
+		InstanceCount = 0;
+		for(int k = 0; k < TechniqueInstanceCount; k++) {
+			InstanceCount += pis[k]["elements"].size();
+		}
+		// all the instances in a single array
+		Instance *Instances = Arena.alloc<Instance>(InstanceCount);
 		InstanceCount = 0;
 
 		for(int k = 0; k < TechniqueInstanceCount; k++) {
@@ -241,12 +539,21 @@ std::cout << "Technique Instances count: " << TechniqueInstanceCount << "\n";
 			nlohmann::json is = pis[k]["elements"];
 			TI[k].InstanceCount = is.size();
 std::cout << "Technique: " << Pid << "(" << k << "), Instances count: " << TI[k].InstanceCount << "\n";
-			TI[k].I = (Instance *)calloc(TI[k].InstanceCount, sizeof(Instance));
+			TI[k].I = Instances + InstanceCount;
+			TI[k].SharedSet = Arena.alloc<bool *>(Npasses);
+			for(int ipas = 0; ipas < Npasses; ipas++) {
+				std::vector<DescriptorSetLayout *> &D = TI[k].T->PT[ipas].P->D;
+				TI[k].SharedSet[ipas] = Arena.alloc<bool>(D.size());
+				for(int h = 0; h < D.size(); h++) {
+					TI[k].SharedSet[ipas][h] =
+						std::find(SharedDSLs.begin(), SharedDSLs.end(), D[h]) != SharedDSLs.end();
+				}
+			}
 			
 			for(int j = 0; j < TI[k].InstanceCount; j++) {
 			
 std::cout << k << "." << j << "\t" << is[j]["id"] << ", " << is[j]["model"] << "(" << MeshIds[is[j]["model"]] << "), {";
-				TI[k].I[j].id  = new std::string(is[j]["id"]);
+				TI[k].I[j].id  = Arena.make<std::string>(is[j]["id"]);
 				TI[k].I[j].Mid = MeshIds[is[j]["model"]];
 				int NTextures = is[j]["texture"].size();
 				if(NTextures != TI[k].T->Ntextures) {
@@ -254,7 +561,7 @@ std::cout << k << "." << j << "\t" << is[j]["id"] << ", " << is[j]["model"] << "
 					exit(0);
 				}
 				TI[k].I[j].NTx = NTextures;
-				TI[k].I[j].Tid = (int *)calloc(NTextures, sizeof(int));
+				TI[k].I[j].Tid = Arena.alloc<int>(NTextures);
 std::cout << "#" << NTextures;
 				for(int h = 0; h < NTextures; h++) {
 					TI[k].I[j].Tid[h] = TextureIds[is[j]["texture"][h]];
@@ -327,31 +634,18 @@ std::cout << "\n";
 					TI[k].I[j].Wm = glm::mat4(TMj[0],TMj[4],TMj[8],TMj[12],TMj[1],TMj[5],TMj[9],TMj[13],TMj[2],TMj[6],TMj[10],TMj[14],TMj[3],TMj[7],TMj[11],TMj[15]);
 				}	
 				TI[k].I[j].TIp = &TI[k];
-				TI[k].I[j].D = (std::vector<DescriptorSetLayout *> **)calloc(sizeof(std::vector<DescriptorSetLayout *> *), Npasses);
-				TI[k].I[j].NDs = (int *)calloc(sizeof(int), Npasses);
+				TI[k].I[j].D = Arena.alloc<std::vector<DescriptorSetLayout *> *>(Npasses);
+				TI[k].I[j].NDs = Arena.alloc<int>(Npasses);
 				for(int ipas = 0; ipas < Npasses; ipas++) {
 					TI[k].I[j].D[ipas] = &TI[k].T->PT[ipas].P->D;
 					TI[k].I[j].NDs[ipas] = TI[k].I[j].D[ipas]->size();
-					BP->DPSZs.setsInPool += TI[k].I[j].NDs[ipas];
-					for(int h = 0; h < TI[k].I[j].NDs[ipas]; h++) {
-						DescriptorSetLayout *DSL = (*TI[k].I[j].D[ipas])[h];
-						int DSLsize = DSL->Bindings.size();
-
-						for (int l = 0; l < DSLsize; l++) {
-							if(DSL->Bindings[l].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
-								BP->DPSZs.uniformBlocksInPool += 1;
-							} else {
-								BP->DPSZs.texturesInPool += 1;
-							}
-						}
-					}
 				}
 				InstanceCount++;
 			}
 		}			
 
 std::cout << "Creating instances\n";
-		I =  (Instance **)calloc(InstanceCount, sizeof(Instance *));
+		I = Arena.alloc<Instance *>(InstanceCount);
 
 		int i = 0;
 		for(int k = 0; k < TechniqueInstanceCount; k++) {
@@ -378,15 +672,54 @@ std::cout << i << " instances created\n";
 }
 
 
+// Runs the jobs on up to loadingThreads workers, and waits for all of them.
+// The first exception thrown by a job is rethrown here.
+void Scene::runLoadingJobs(std::vector<std::function<void()>> &jobs) {
+	int nThreads = loadingThreads > 0 ? loadingThreads :
+				   std::max(1, (int)std::thread::hardware_concurrency());
+	nThreads = std::min(nThreads, (int)jobs.size());
+	if(nThreads <= 1) {
+		for(auto &job : jobs) {
+			job();
+		}
+		return;
+	}
+	
+	std::atomic<int> next(0);
+	std::exception_ptr error = nullptr;
+	std::mutex errorLock;
+	std::vector<std::thread> workers;
+	for(int w = 0; w < nThreads; w++) {
+		workers.emplace_back([&]() {
+			for(int j = next++; j < jobs.size(); j = next++) {
+				try {
+					jobs[j]();
+				} catch(...) {
+					std::lock_guard<std::mutex> guard(errorLock);
+					if(error == nullptr) {
+						error = std::current_exception();
+					}
+				}
+			}
+		});
+	}
+	for(auto &w : workers) {
+		w.join();
+	}
+	if(error != nullptr) {
+		std::rethrow_exception(error);
+	}
+}
+
 void Scene::pipelinesAndDescriptorSetsInit() {
 //std::cout << "Scene DS init\n";
 	for(int i = 0; i < InstanceCount; i++) {
 //std::cout << "I: " << i << ", NTx: " << I[i]->NTx << ", NDs: " << I[i]->NDs << ", nPasses: " << Npasses << "\n";
 
-		I[i]->DS = (DescriptorSet ***)calloc(Npasses, sizeof(DescriptorSet **));
+		I[i]->DS = DSArena.alloc<DescriptorSet **>(Npasses);
 		for(int ipas = 0; ipas < Npasses; ipas++) {
 //std::cout << "DSs for pass " << ipas << ": " << I[i]->NDs[ipas] << "\n";
-			I[i]->DS[ipas] = (DescriptorSet **)calloc(I[i]->NDs[ipas], sizeof(DescriptorSet *));
+			I[i]->DS[ipas] = DSArena.alloc<DescriptorSet *>(I[i]->NDs[ipas]);
 			for(int j = 0; j < I[i]->NDs[ipas]; j++) {
 				std::vector<VkDescriptorImageInfo> Tids = {};
 				TechniqueRef *Tr = I[i]->TIp->T;
@@ -395,6 +728,10 @@ void Scene::pipelinesAndDescriptorSetsInit() {
 //std::cout << "DSs " << j << " for pass " << ipas << " has " << ntxs << " textures\n";
 				for(int kt = 0; kt < ntxs; kt++) {
 					if(Tr->PT[ipas].texDefs[j][kt].fromInstance) {
+						if(I[i]->TIp->SharedSet[ipas][j]) {
+							std::cout << "Scene Error: shared set " << j << " of technique " << *Tr->id << " uses instance textures\n";
+							exit(0);
+						}
 						Tids[kt] = T[I[i]->Tid[
 									  Tr->PT[ipas].texDefs[j][kt].pos
 								    ]]->getViewAndSampler();
@@ -406,9 +743,32 @@ void Scene::pipelinesAndDescriptorSetsInit() {
 					}
 				}
 
-				I[i]->DS[ipas][j] = new DescriptorSet();
+				DescriptorSetLayout *DSL = (*I[i]->D[ipas])[j];
+				if(I[i]->TIp->SharedSet[ipas][j]) {
+					if(SharedDS.find(DSL) == SharedDS.end()) {
+						SharedDS[DSL] = DSArena.make<DescriptorSet>();
+						SharedDS[DSL]->init(BP, DSL, Tids);
+						SharedTids[DSL] = Tids;
+					} else {
+						const std::vector<VkDescriptorImageInfo> &Sids = SharedTids[DSL];
+						bool same = (Sids.size() == Tids.size());
+						for(int kt = 0; same && (kt < Tids.size()); kt++) {
+							same = (Sids[kt].sampler == Tids[kt].sampler) &&
+								   (Sids[kt].imageView == Tids[kt].imageView) &&
+								   (Sids[kt].imageLayout == Tids[kt].imageLayout);
+						}
+						if(!same) {
+							std::cout << "Scene Error: shared set " << j << " of technique " << *Tr->id << " uses different textures from the other techniques with the same layout\n";
+							exit(0);
+						}
+					}
+					I[i]->DS[ipas][j] = SharedDS[DSL];
+					continue;
+				}
+
+				I[i]->DS[ipas][j] = DSArena.make<DescriptorSet>();
 //std::cout << "Allocating DS for DSL: " << (*I[i]->D[ipas])[j] << ", with " << Tids.size() << " textures\n";
-				I[i]->DS[ipas][j]->init(BP, (*I[i]->D[ipas])[j], Tids);
+				I[i]->DS[ipas][j]->init(BP, DSL, Tids);
 //std::cout << "DSs " << j << " for pass " << ipas << " done!\n";
 			}
 		}
@@ -421,41 +781,56 @@ void Scene::pipelinesAndDescriptorSetsCleanup() {
 	for(int i = 0; i < InstanceCount; i++) {
 		for(int ipas = 0; ipas < Npasses; ipas++) {
 			for(int j = 0; j < I[i]->NDs[ipas]; j++) {
+				if(I[i]->TIp->SharedSet[ipas][j]) {
+					continue;
+				}
 				I[i]->DS[ipas][j]->cleanup();
-				delete I[i]->DS[ipas][j];
 			}
-			free(I[i]->DS[ipas]);
 		}
-		free(I[i]->DS);
+		I[i]->DS = nullptr;
 	}
+	for(auto &SDS : SharedDS) {
+		SDS.second->cleanup();
+	}
+	SharedDS.clear();
+	SharedTids.clear();
+	DSArena.reset();
+}
+
+DescriptorSet *Scene::getSharedDescriptorSet(DescriptorSetLayout *DSL) {
+	auto found = SharedDS.find(DSL);
+	return found != SharedDS.end() ? found->second : nullptr;
 }
 
 void Scene::localCleanup() {
 	// Cleanup textures
 	for(int i = 0; i < TextureCount; i++) {
 		T[i]->cleanup();
-		delete T[i];
 	}
-	free(T);
 	
 	// Cleanup models
 	for(int i = 0; i < ModelCount; i++) {
 		M[i]->cleanup();
-		delete M[i];
 	}
-	free(M);
+	cleanupMergedGeometry();
 	
-	for(int i = 0; i < InstanceCount; i++) {
-		delete I[i]->id;
-		free(I[i]->Tid);
+	// Asset files still used by animations are kept by the registry
+	for(int k = 0; k < AssetFileCount; k++) {
+		BP->assetRegistry.release(As[k]);
 	}
-	free(I);
 	
-	// To add: delete the also the datastructure relative to the pipeline
-	for(int i = 0; i < TechniqueInstanceCount; i++) {
-		free(TI[i].I);
-	}
-	free(TI);
+	cleanupSecondaryCommandBuffers();
+	recordingWorkers.stop();
+	
+	// models, textures and instances are all in the arena
+	Arena.release();
+	DSArena.release();
+	AsIds.clear();
+	MeshIds.clear();
+	TextureIds.clear();
+	InstanceIds.clear();
+	AssetFileCount = ModelCount = TextureCount = 0;
+	InstanceCount = TechniqueInstanceCount = 0;
 }
 
 void Scene::populateCommandBuffer(VkCommandBuffer commandBuffer, int passId, int currentImage) {
@@ -467,23 +842,301 @@ void Scene::populateCommandBuffer(VkCommandBuffer commandBuffer, int passId, int
 //std::cout << "Generating draw calls for pass " << passId << "\n";
 	for(int k = 0; k < TechniqueInstanceCount; k++) {
 //std::cout << "Considering technique " << k << "\n";
-		for(int i = 0; i < TI[k].InstanceCount; i++) {
-			Pipeline *P = TI[k].T->PT[passId].P;
-			if(P != nullptr) {
-				P->bind(commandBuffer);
+		if(TI[k].InstanceCount == 0) {
+			continue;
+		}
+		std::string scopeName = *TI[k].T->id;
+		if(Npasses > 1) {
+			scopeName += " (pass " + std::to_string(passId) + ")";
+		}
+		recordTechnique(commandBuffer, passId, currentImage, k, 0, TI[k].InstanceCount,
+						BP->gpuProfiler.registerScope(scopeName));
+	}
+}
 
+// Records the instances first to last - 1 of technique k. Each range binds
+// the pipeline and the shared sets, so it can be recorded in a buffer of its
+// own; the profiler scope starts in the first range and ends in the last one.
+void Scene::recordTechnique(VkCommandBuffer commandBuffer, int passId, int currentImage, int k,
+							int first, int last, int profScope) {
+	if(first == 0) {
+		BP->gpuProfiler.beginScope(commandBuffer, currentImage, profScope);
+	}
+	Pipeline *P = TI[k].T->PT[passId].P;
+	bool *Shared = TI[k].SharedSet[passId];
+	if((P != nullptr) && (first < last)) {
+		// all the instances of the technique use the same pipeline and shared sets
+		P->bind(commandBuffer);
+		for(int j = 0; j < TI[k].I[0].NDs[passId]; j++) {
+			if(Shared[j]) {
+				TI[k].I[0].DS[passId][j]->bind(commandBuffer, *P, j, currentImage);
+			}
+		}
+	}
+	int boundGeometry = -1;
+	for(int i = first; i < last; i++) {
+		if(P != nullptr) {
 //std::cout << "Drawing Instance " << i << "\n";
-				M[TI[k].I[i].Mid]->bind(commandBuffer);
-				for(int j = 0; j < TI[k].I[i].NDs[passId]; j++) {
-//std::cout << "Binding DS: set " << j << "\n";
-					TI[k].I[i].DS[passId][j]->bind(commandBuffer, *P, j, currentImage);
+			int Mid = TI[k].I[i].Mid;
+			uint32_t firstIndex = 0;
+			int32_t vertexOffset = 0;
+			if(mergeGeometry) {
+				const SceneMeshRange &R = MeshRanges[Mid];
+				if(R.geometry != boundGeometry) {
+					VkDeviceSize offsets[] = {0};
+					vkCmdBindVertexBuffers(commandBuffer, 0, 1, &Geometry[R.geometry].vertexBuffer, offsets);
+					vkCmdBindIndexBuffer(commandBuffer, Geometry[R.geometry].indexBuffer, 0,
+											VK_INDEX_TYPE_UINT32);
+					boundGeometry = R.geometry;
 				}
+				firstIndex = R.firstIndex;
+				vertexOffset = R.vertexOffset;
+			} else {
+				M[Mid]->bind(commandBuffer);
+			}
+			for(int j = 0; j < TI[k].I[i].NDs[passId]; j++) {
+				if(Shared[j]) {
+					continue;
+				}
+//std::cout << "Binding DS: set " << j << "\n";
+				TI[k].I[i].DS[passId][j]->bind(commandBuffer, *P, j, currentImage);
+			}
 //std::cout << "Draw Call\n";						
-				vkCmdDrawIndexed(commandBuffer,
-						static_cast<uint32_t>(M[TI[k].I[i].Mid]->indices.size()), 1, 0, 0, 0);
+			vkCmdDrawIndexed(commandBuffer,
+					static_cast<uint32_t>(M[Mid]->indexCount()), 1, firstIndex, vertexOffset, 0);
+		}
+	}
+	if(last == TI[k].InstanceCount) {
+		BP->gpuProfiler.endScope(commandBuffer, currentImage, profScope);
+	}
+}
+
+// Packs the geometry of all the models with the same vertex format in a
+// single pair of buffers. Indices are copied unchanged: the draw calls add
+// the vertexOffset of the model. Must be called inside the staging batch
+// of init(), after all the models have been loaded.
+void Scene::createMergedGeometry() {
+	std::unordered_map<VertexDescriptor *, int> GeometryIds;
+	std::vector<VkDeviceSize> vertexBytes;
+	std::vector<VkDeviceSize> indexCount;
+	
+	MeshRanges.resize(ModelCount);
+	for(int k = 0; k < ModelCount; k++) {
+		VertexDescriptor *VD = M[k]->VD;
+		if(GeometryIds.find(VD) == GeometryIds.end()) {
+			GeometryIds[VD] = Geometry.size();
+			SceneGeometry G{};
+			G.VD = VD;
+			Geometry.push_back(G);
+			vertexBytes.push_back(0);
+			indexCount.push_back(0);
+		}
+		int g = GeometryIds[VD];
+		MeshRanges[k].geometry = g;
+		MeshRanges[k].firstIndex = static_cast<uint32_t>(indexCount[g]);
+		MeshRanges[k].vertexOffset = static_cast<int32_t>(vertexBytes[g] / VD->Bindings[0].stride);
+		vertexBytes[g] += M[k]->vertexDataSize();
+		indexCount[g] += M[k]->indexCount();
+	}
+	
+	for(int g = 0; g < Geometry.size(); g++) {
+		createGeometryBuffer(vertexBytes[g], VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+							 Geometry[g].vertexBuffer, Geometry[g].vertexBufferMemory);
+		createGeometryBuffer(indexCount[g] * sizeof(uint32_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+							 Geometry[g].indexBuffer, Geometry[g].indexBufferMemory);
+		std::cout << "Merged geometry " << g << ": " << vertexBytes[g] / Geometry[g].VD->Bindings[0].stride
+				  << " vertices, " << indexCount[g] << " indices\n";
+	}
+	
+	for(int k = 0; k < ModelCount; k++) {
+		SceneGeometry &G = Geometry[MeshRanges[k].geometry];
+		VkDeviceSize vOff = (VkDeviceSize)MeshRanges[k].vertexOffset * G.VD->Bindings[0].stride;
+		VkDeviceSize iOff = (VkDeviceSize)MeshRanges[k].firstIndex * sizeof(uint32_t);
+		VkDeviceSize vSize = M[k]->vertexDataSize();
+		VkDeviceSize iSize = M[k]->indexCount() * sizeof(uint32_t);
+		if(G.vertexBufferMemory.mapped != nullptr) {
+			memcpy(static_cast<char *>(G.vertexBufferMemory.mapped) + vOff, M[k]->vertexData(), (size_t)vSize);
+			memcpy(static_cast<char *>(G.indexBufferMemory.mapped) + iOff, M[k]->indexData(), (size_t)iSize);
+		} else {
+			BP->stagingUploader.uploadBuffer(G.vertexBuffer, M[k]->vertexData(), vSize, vOff);
+			BP->stagingUploader.uploadBuffer(G.indexBuffer, M[k]->indexData(), iSize, iOff);
+		}
+	}
+}
+
+// Same placement rules of the buffers of the Model class
+void Scene::createGeometryBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+							  VkBuffer &buffer, GPUAllocation &memory) {
+	// zero sized buffers are not allowed
+	size = std::max(size, (VkDeviceSize)4);
+	if(BP->memoryAllocator.unifiedMemory) {
+		BP->createBuffer(size, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+									  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+									  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+						 buffer, memory, GMT_MESH);
+	} else {
+		BP->createBuffer(size, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+						 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, memory, GMT_MESH);
+	}
+}
+
+void Scene::cleanupMergedGeometry() {
+	for(int g = 0; g < Geometry.size(); g++) {
+		vkDestroyBuffer(BP->device, Geometry[g].vertexBuffer, BP->allocationCallbacks);
+		BP->memoryAllocator.free(Geometry[g].vertexBufferMemory);
+		vkDestroyBuffer(BP->device, Geometry[g].indexBuffer, BP->allocationCallbacks);
+		BP->memoryAllocator.free(Geometry[g].indexBufferMemory);
+	}
+	Geometry.clear();
+	MeshRanges.clear();
+}
+
+// Records each technique, or each range of instances of the techniques with
+// many instances, in a secondary command buffer, on several threads, and
+// queues them in RP, that must have been started with secondaryContents
+// set, to be executed by RP->end().
+// The secondary buffers of (passId, currentImage) are reused by the next call
+// with the same parameters: as for the primary buffer, this must happen only
+// when the previous recording is no longer in use by the GPU.
+void Scene::populateCommandBuffer(VkCommandBuffer commandBuffer, int passId, int currentImage, RenderPass *RP) {
+	if(passId >= Npasses) {
+		std::cout << "Scene Error: requested a pass too high in scene : " << passId << " >= " << Npasses << "\n";
+		exit(0);
+	}
+	if(!RP->secondaryContents) {
+		populateCommandBuffer(commandBuffer, passId, currentImage);
+		return;
+	}
+	
+	if(secondaryImages != RP->frameBuffers.size()) {
+		// the number of swap chain images has changed: the device is idle
+		cleanupSecondaryCommandBuffers();
+		createSecondaryCommandBuffers(RP->frameBuffers.size());
+	}
+	int nPools = threadPools.size();
+	
+	// the scope table of the profiler is not thread safe: fill it here
+	struct DrawRange {
+		int k, first, last;
+	};
+	std::vector<DrawRange> todo;
+	std::vector<int> profScopes(TechniqueInstanceCount, -1);
+	int totalDraws = 0;
+	for(int k = 0; k < TechniqueInstanceCount; k++) {
+		int count = TI[k].InstanceCount;
+		if((count == 0) || (TI[k].T->PT[passId].P == nullptr)) {
+			continue;
+		}
+		std::string scopeName = *TI[k].T->id;
+		if(Npasses > 1) {
+			scopeName += " (pass " + std::to_string(passId) + ")";
+		}
+		profScopes[k] = BP->gpuProfiler.registerScope(scopeName);
+		int nRanges = std::min(nPools, std::max(1, count / minDrawsPerThread));
+		for(int r = 0; r < nRanges; r++) {
+			todo.push_back({k, count * r / nRanges, count * (r + 1) / nRanges});
+		}
+		totalDraws += count;
+	}
+	
+	VkCommandBufferInheritanceInfo inheritanceInfo = RP->getInheritanceInfo(currentImage);
+	int base = (passId * secondaryImages + currentImage) * nPools;
+	std::vector<VkCommandBuffer> recorded(todo.size());
+	
+	// worker t records the ranges i with i % nPools == t, in the buffers
+	// of its pool: the pool is used by a single thread
+	auto recordSlice = [&](int t) {
+		std::vector<VkCommandBuffer> &CBs = secondaryCBs[base + t];
+		int used = 0;
+		for(int i = t; i < todo.size(); i += nPools) {
+			if(used == CBs.size()) {
+				VkCommandBufferAllocateInfo allocInfo{};
+				allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+				allocInfo.commandPool = threadPools[t];
+				allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+				allocInfo.commandBufferCount = 1;
+				
+				VkCommandBuffer cb;
+				VkResult result = vkAllocateCommandBuffers(BP->device, &allocInfo, &cb);
+				if (result != VK_SUCCESS) {
+					PrintVkError(result);
+					throw std::runtime_error("failed to allocate secondary command buffer!");
+				}
+				CBs.push_back(cb);
+			}
+			VkCommandBuffer scb = CBs[used++];
+			
+			VkCommandBufferBeginInfo beginInfo{};
+			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+			beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+			beginInfo.pInheritanceInfo = &inheritanceInfo;
+			if (vkBeginCommandBuffer(scb, &beginInfo) != VK_SUCCESS) {
+				throw std::runtime_error("failed to begin recording secondary command buffer!");
+			}
+			const DrawRange &D = todo[i];
+			recordTechnique(scb, passId, currentImage, D.k, D.first, D.last, profScopes[D.k]);
+			if (vkEndCommandBuffer(scb) != VK_SUCCESS) {
+				throw std::runtime_error("failed to record secondary command buffer!");
+			}
+			recorded[i] = scb;
+		}
+	};
+
+	// small scenes are not worth the cost of starting the threads
+	int nThreads = std::min(nPools, std::max(1, totalDraws / minDrawsPerThread));
+	if(nThreads <= 1) {
+		for(int t = 0; t < nPools; t++) {
+			recordSlice(t);
+		}
+	} else {
+		if(recordingWorkers.threads.empty()) {
+			recordingWorkers.start(nPools - 1);
+		}
+		recordingWorkers.run(nThreads, [&](int w) {
+			for(int t = w; t < nPools; t += nThreads) {
+				recordSlice(t);
 			}
+		});
+	}
+	
+	// executed in the same order as the single threaded version
+	for(VkCommandBuffer scb : recorded) {
+		RP->addSecondary(scb);
+	}
+}
+
+void Scene::createSecondaryCommandBuffers(int nImages) {
+	int nPools = recordingThreads > 0 ? recordingThreads :
+				 std::max(1, (int)std::thread::hardware_concurrency());
+	
+	QueueFamilyIndices queueFamilyIndices = BP->findQueueFamilies(BP->physicalDevice);
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+
+	threadPools.resize(nPools);
+	for(int t = 0; t < nPools; t++) {
+		VkResult result = vkCreateCommandPool(BP->device, &poolInfo, BP->allocationCallbacks, &threadPools[t]);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create command pool!");
 		}
 	}
+	
+	// the buffers are allocated by the first recordings
+	secondaryImages = nImages;
+	secondaryCBs.assign(Npasses * nImages * nPools, std::vector<VkCommandBuffer>());
+}
+
+void Scene::cleanupSecondaryCommandBuffers() {
+	// destroying the pools frees their command buffers
+	for(int t = 0; t < threadPools.size(); t++) {
+		vkDestroyCommandPool(BP->device, threadPools[t], BP->allocationCallbacks);
+	}
+	threadPools.clear();
+	secondaryCBs.clear();
+	secondaryImages = 0;
 }
 
 #endif
\ No newline at end of file
@@ -15,7 +15,24 @@
 #include <math.h>
 #include <chrono>
 #include <unordered_map>
+#include <unordered_set>
 #include <map>
+#include <atomic>
+#include <thread>
+#include <sstream>
+#include <iomanip>
+#include <mutex>
+#include <condition_variable>
+#include <filesystem>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #ifdef STARTER_IMPLEMENTATION
 // to allow splitting header and implementation
@@ -74,7 +91,8 @@
 #define M_SQRT1_2	0.70710678118654752440	/* 1/sqrt(2) */
 
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
+// upper limit for BaseProject::setFramesInFlight()
+const int MAX_FRAMES_IN_FLIGHT = 4;
 
 const std::vector<const char*> validationLayers = {
 	"VK_LAYER_KHRONOS_validation"
@@ -105,6 +123,8 @@ void DestroyDebugUtilsMessengerEXT(VkInstance instance,
 void PrintVkError( VkResult result );
 
 std::vector<char> readFile(const std::string& filename);
+uint64_t hashBytes(const void *data, size_t size, uint64_t key = 14695981039346656037ull);
+std::vector<char> decodeMGCG(const std::vector<char> &encoded);
 
 class BaseProject;
 
@@ -153,41 +173,331 @@ struct VertexDescriptor {
 						getAttributeDescriptions();
 };
 
+struct GPUMemoryRange {
+	VkDeviceSize offset;
+	VkDeviceSize size;
+};
+
+// Free lists are kept sorted by offset, with adjacent ranges merged
+bool allocateRange(std::vector<GPUMemoryRange> &freeList, VkDeviceSize size,
+				   VkDeviceSize alignment, VkDeviceSize &offset);
+void releaseRange(std::vector<GPUMemoryRange> &freeList, VkDeviceSize offset,
+				  VkDeviceSize size);
+
+struct GPUMemoryBlock {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	uint32_t memoryType = 0;
+	VkDeviceSize size = 0;
+	VkDeviceSize used = 0;
+	int allocations = 0;
+	void *mapped = nullptr;
+	// sorted by offset, adjacent ranges are always merged
+	std::vector<GPUMemoryRange> freeList;
+};
+
+// What the memory is used for, and how long it is expected to live:
+// used only for accounting and leak detection
+enum GPUMemoryTag {GMT_OTHER, GMT_MESH, GMT_TEXTURE, GMT_UNIFORM, GMT_ATTACHMENT,
+				   GMT_STAGING, GMT_COUNT};
+enum GPUMemoryLifetime {GML_STATIC, GML_SWAPCHAIN, GML_TRANSIENT, GML_COUNT};
+
+// A piece of a memory block: resources are bound to memory at offset.
+// mapped is already offset, and is null if the memory is not host visible.
+struct GPUAllocation {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	void *mapped = nullptr;
+	GPUMemoryBlock *block = nullptr;
+	// -1 for dedicated allocations
+	int pool = -1;
+	GPUMemoryTag tag = GMT_OTHER;
+	GPUMemoryLifetime lifetime = GML_STATIC;
+};
+
+struct GPUMemoryStats {
+	int blocks;
+	int allocations;
+	VkDeviceSize bytesAllocated;
+	VkDeviceSize bytesUsed;
+	VkDeviceSize largestFreeRange;
+	// 0 when all the free memory is contiguous, close to 1 when it is
+	// split in many small ranges
+	float fragmentation;
+};
+
+// Sub-allocator for device memory. Every memory type has two pools of
+// large blocks, one for buffers and linear images and one for optimal
+// images, so bufferImageGranularity never matters between neighbours.
+// Host visible blocks are mapped once, when they are created.
+struct GPUMemoryAllocator {
+	BaseProject *BP;
+	VkDevice device = VK_NULL_HANDLE;
+	VkPhysicalDeviceMemoryProperties memProperties;
+	// true when the largest device local heap is also host visible
+	// (integrated GPUs), so there is no point in staging uploads
+	bool unifiedMemory = false;
+	
+	static const VkDeviceSize defaultBlockSize = 64ull * 1024 * 1024;
+	VkDeviceSize blockSize[VK_MAX_MEMORY_TYPES];
+	
+	// pools[2 * memoryType + 1] holds the optimal images
+	std::vector<GPUMemoryBlock *> pools[2 * VK_MAX_MEMORY_TYPES];
+	std::vector<GPUMemoryBlock *> dedicated;
+	std::mutex lock;
+	
+	// bytes and allocations of each tag and lifetime, currently alive
+	VkDeviceSize taggedBytes[GMT_COUNT][GML_COUNT] = {};
+	int taggedCount[GMT_COUNT][GML_COUNT] = {};
+	VkDeviceSize peakBytesUsed = 0;
+	// usage after the last swap chain recreation, to spot growth
+	VkDeviceSize lastRecreationBytes = 0;
+	int recreations = 0;
+	// VK_EXT_memory_budget has been enabled on the device
+	bool hasMemoryBudget = false;
+	
+	void init(BaseProject *bp);
+	void cleanup();
+	GPUAllocation allocate(const VkMemoryRequirements &memRequirements,
+						   VkMemoryPropertyFlags properties, bool optimalImage,
+						   GPUMemoryTag tag = GMT_OTHER, GPUMemoryLifetime lifetime = GML_STATIC);
+	void free(GPUAllocation &alloc);
+	GPUMemoryStats getStats();
+	void printStats();
+	void printReport();
+	VkDeviceSize getTaggedBytes(GPUMemoryTag tag);
+	bool getBudget(std::vector<VkDeviceSize> &heapUsage, std::vector<VkDeviceSize> &heapBudget);
+	void trackSwapChainMemory();
+	static const char *tagNames[GMT_COUNT];
+	static const char *lifetimeNames[GML_COUNT];
+
+	GPUMemoryBlock *createBlock(uint32_t memoryType, VkDeviceSize size);
+	void destroyBlock(GPUMemoryBlock *block);
+	bool allocateFromBlock(GPUMemoryBlock *block, VkDeviceSize size,
+						   VkDeviceSize alignment, VkDeviceSize &offset);
+};
+
+// Copies data into device local buffers through a host visible staging
+// buffer. Copies are recorded in a single command buffer that is submitted
+// when the staging buffer wraps around, or at the end of the batch: between
+// beginBatch() and endBatch() any number of uploads share one submission.
+// Outside a batch, every upload is submitted immediately.
+struct StagingUploader {
+	BaseProject *BP;
+	static const VkDeviceSize capacity = 16 * 1024 * 1024;
+	
+	VkBuffer stagingBuffer = VK_NULL_HANDLE;
+	GPUAllocation stagingMemory;
+	VkDeviceSize head = 0;
+	VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+	int batchDepth = 0;
+	int submissions = 0;
+	
+	void init(BaseProject *bp);
+	void cleanup();
+	void beginBatch();
+	void endBatch();
+	void uploadBuffer(VkBuffer dst, const void *src, VkDeviceSize size,
+					  VkDeviceSize dstOffset = 0);
+	void flush();
+};
+
+// One buffer of the uniform ring, split in one region per swap chain image
+struct UniformRingPage {
+	VkBuffer buffer = VK_NULL_HANDLE;
+	GPUAllocation memory;
+	// free ranges of a region: all the regions have the same layout
+	std::vector<GPUMemoryRange> freeList;
+	int slots = 0;
+};
+
+struct UniformSlot {
+	UniformRingPage *page = nullptr;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+};
+
+// Storage of all the uniform blocks, used through dynamic uniform buffer
+// descriptors. A slot has the same offset in every region, so a single
+// descriptor serves all the swap chain images: the region of the image
+// is selected by the dynamic offset passed when the set is bound, and the
+// uniforms of a frame are written contiguously in its region.
+struct UniformRing {
+	BaseProject *BP;
+	static const VkDeviceSize regionSize = 1024 * 1024;
+	
+	VkDeviceSize alignment = 256;
+	VkDeviceSize regionStride = regionSize;
+	int imageCount = 0;
+	std::vector<UniformRingPage *> pages;
+	
+	void init(BaseProject *bp, int nImages);
+	void cleanup();
+	void setImageCount(int nImages);
+	UniformSlot allocate(VkDeviceSize size);
+	void free(UniformSlot &slot);
+	uint32_t getDynamicOffset(int currentImage) {
+		return static_cast<uint32_t>(currentImage * regionStride);
+	}
+	void *getMapped(const UniformSlot &slot, int currentImage) {
+		return static_cast<char *>(slot.page->memory.mapped) +
+			   currentImage * regionStride + slot.offset;
+	}
+};
+
+// Host memory requested by the Vulkan driver, counted per
+// VkSystemAllocationScope (command, object, cache, device, instance)
+struct HostAllocationCounters {
+	static const int scopeCount = 5;
+	uint64_t allocations[scopeCount] = {};
+	uint64_t bytes[scopeCount] = {};
+	uint64_t internalAllocations[scopeCount] = {};
+	uint64_t internalBytes[scopeCount] = {};
+	
+	uint64_t totalAllocations() const;
+	uint64_t totalBytes() const;
+};
+
+// Allocations made by the driver while running a section of the code
+// (for example a swap chain recreation), summed over all its runs
+struct HostAllocationSection {
+	int runs = 0;
+	HostAllocationCounters counters;
+};
+
+// Host allocator passed to every create and destroy call of Vulkan.
+// Small blocks are recycled through free lists by size class, since the
+// driver frees command scope allocations before the call returns.
+// A project can plug its own callbacks by setting allocationCallbacks
+// of BaseProject before run().
+struct HostAllocator {
+	static const int sizeClasses = 7;
+	static const size_t minClassSize = 64;
+	
+	VkAllocationCallbacks callbacks{};
+	std::mutex lock;
+	std::vector<void *> freeBlocks[sizeClasses];
+	HostAllocationCounters counters;
+	int64_t liveBytes[HostAllocationCounters::scopeCount] = {};
+	int64_t liveAllocations[HostAllocationCounters::scopeCount] = {};
+	int64_t peakBytes = 0;
+	uint64_t pooledAllocations = 0;
+	std::map<std::string, HostAllocationSection> sections;
+	
+	const VkAllocationCallbacks *init();
+	void cleanup();
+	HostAllocationCounters getCounters();
+	// adds what has been allocated since start to the named section
+	HostAllocationCounters addSection(const std::string &name, const HostAllocationCounters &start);
+	void printStats();
+	static const char *scopeNames[HostAllocationCounters::scopeCount];
+	
+	void *allocate(size_t size, size_t alignment, VkSystemAllocationScope scope);
+	void *reallocate(void *original, size_t size, size_t alignment, VkSystemAllocationScope scope);
+	void release(void *memory);
+	
+	static void *VKAPI_PTR allocationFunction(void *pUserData, size_t size,
+					size_t alignment, VkSystemAllocationScope scope);
+	static void *VKAPI_PTR reallocationFunction(void *pUserData, void *pOriginal,
+					size_t size, size_t alignment, VkSystemAllocationScope scope);
+	static void VKAPI_PTR freeFunction(void *pUserData, void *pMemory);
+	static void VKAPI_PTR internalAllocationNotification(void *pUserData, size_t size,
+					VkInternalAllocationType type, VkSystemAllocationScope scope);
+	static void VKAPI_PTR internalFreeNotification(void *pUserData, size_t size,
+					VkInternalAllocationType type, VkSystemAllocationScope scope);
+};
+
 enum ModelType {OBJ, GLTF, MGCG};
 
+// Read only view of a whole file (memory mapped where available)
+struct MappedFile {
+	const unsigned char *data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	std::vector<unsigned char> buffer;
+#endif
+	
+	bool open(const std::string &name);
+	void close();
+};
+
+// Layout of a cooked mesh file: the header is followed by the
+// interleaved vertices and, at the next multiple of 4, by the indices
+struct MeshCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t key;
+	uint64_t vertexBytes;
+	uint64_t indexCount;
+	float Wm[16];
+};
+
 class AssetFile;
 
 class Model {
+	friend class Scene;
 	BaseProject *BP;
 	
 	VkBuffer vertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
+	GPUAllocation vertexBufferMemory;
 	VkBuffer indexBuffer;
-	VkDeviceMemory indexBufferMemory;
+	GPUAllocation indexBufferMemory;
 	VertexDescriptor *VD;
 
 	public:
+	// meshes rebuilt while rendering stay in host visible memory,
+	// to avoid waiting for a staging upload
+	bool hostVisible = false;
+	// false when the geometry is stored in buffers owned by someone else
+	// (like the merged buffers of a Scene): only the CPU copy is kept
+	bool ownBuffers = true;
 	glm::mat4 Wm;
 	std::vector<unsigned char> vertices{};
 	std::vector<uint32_t> indices{};
+	// set when the mesh comes from the cache: the geometry is read and
+	// uploaded straight from the mapped file, and the vectors stay empty
+	MappedFile *cacheFile = nullptr;
+	const unsigned char *vertexData() {
+		return cacheFile ? cacheFile->data + sizeof(MeshCacheHeader) : vertices.data();
+	}
+	size_t vertexDataSize();
+	const uint32_t *indexData();
+	size_t indexCount();
+	
 	void loadModelOBJ(std::string file);
 	void makeOBJMesh(const tinyobj::shape_t *M, const tinyobj::attrib_t *A);
 	static void getGLTFnodeTransforms(const tinygltf::Node *N, glm::vec3 &T, glm::vec3 &S, glm::quat &Q);
 	void makeGLTFwm(const tinygltf::Node *N);
 	void makeGLTFMesh(tinygltf::Model *M, const tinygltf::Primitive *Prm);
+	static void benchmarkGLTFMesh(std::string file, VertexDescriptor *VD, int iterations = 20);
 	void loadModelGLTF(std::string file, bool encoded);
+	// loadModelGLTF() through the cooked mesh cache of BaseProject::meshCacheDir
+	void loadModelGLTFCached(std::string file, bool encoded);
+	static uint64_t meshCacheKey(const std::string &file, const std::vector<char> &source,
+								 VertexDescriptor *VD, bool encoded);
+	bool loadMeshCache(const std::string &name, uint64_t key);
+	void saveMeshCache(const std::string &name, uint64_t key);
 	void createIndexBuffer();
 	void createVertexBuffer();
 
 	void init(BaseProject *bp, VertexDescriptor *VD, std::string file, ModelType MT);
 	void initFromAsset(BaseProject *bp, VertexDescriptor *VD, AssetFile *AF, std::string AN, int Mid = 0, std::string NN = "");
+	// init() split in two: load() and loadFromAsset() only build the CPU copy
+	// of the mesh and can run in a worker thread, upload() creates the buffers
+	void load(BaseProject *bp, VertexDescriptor *VD, std::string file, ModelType MT);
+	void loadFromAsset(BaseProject *bp, VertexDescriptor *VD, AssetFile *AF, std::string AN, int Mid = 0, std::string NN = "");
+	void upload();
 	void initMesh(BaseProject *bp, VertexDescriptor *VD, bool printDebug = true);
 	void cleanup();
   	void bind(VkCommandBuffer commandBuffer);
 };
 
+struct AssetRegistry;
+
 class AssetFile {
 	friend Model;
+	friend AssetRegistry;
 	
 	tinygltf::Model model;
 	std::unordered_map<std::string, std::vector<const tinygltf::Primitive *>> GLTFmeshes;
@@ -202,7 +512,11 @@ class AssetFile {
 	ModelType type;
 	
 	public:
+	// set when the file is shared through an AssetRegistry
+	AssetRegistry *registry = nullptr;
+	
 	void initGLTF(std::string file);
+	void initGLTF(const std::vector<char> &data, std::string file, bool encoded);
 	void initOBJ(std::string file);
 	void init(std::string file, ModelType MT);
 	ModelType getType() {return type;}
@@ -210,16 +524,49 @@ class AssetFile {
 	void cleanup();
 };
 
+// Asset files shared by everything that reads them (scenes, models and
+// animations): each file is parsed once. Files are looked up by canonical
+// path, and then by the hash of their content and of the directory their
+// external buffers and images are read from, so copies of the same file
+// are also parsed once.
+// acquire() and retain() add a reference, release() deletes the file
+// with the last one.
+struct AssetRegistry {
+	struct Entry {
+		AssetFile *AF;
+		int refs;
+		std::once_flag parsed;
+		std::vector<std::string> paths;
+	};
+	std::mutex lock;
+	std::unordered_map<uint64_t, Entry *> entries;
+	std::unordered_map<std::string, Entry *> paths;
+	std::unordered_map<AssetFile *, uint64_t> keys;
+	int parses = 0;
+	int hits = 0;
+	
+	AssetFile *acquire(std::string file, ModelType MT);
+	void retain(AssetFile *AF);
+	void release(AssetFile *AF);
+	void cleanup();
+};
+
 struct Texture {
 	BaseProject *BP;
 	uint32_t mipLevels;
 	VkImage textureImage;
-	VkDeviceMemory textureImageMemory;
+	GPUAllocation textureImageMemory;
 	VkImageView textureImageView;
 	VkSampler textureSampler;
 	int imgs;
 	static const int maxImgs = 6;
+	// images decoded by loadImages(), released when they are uploaded
+	stbi_uc *pixels[maxImgs];
+	int texWidth, texHeight;
 	
+	// loadImages() only decodes the files and can run in a worker thread
+	void loadImages(std::vector<std::string>files);
+	void uploadTextureImage(VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB);
 	void createTextureImage(std::vector<std::string>files, VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB);
 	void createTextureImageView(VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB);
 	void createTextureSampler(VkFilter magFilter = VK_FILTER_LINEAR,
@@ -234,6 +581,7 @@ struct Texture {
 
 	void init(BaseProject *bp, std::string file, VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB, bool initSampler = true);
 	void initCubic(BaseProject *bp, std::vector<std::string>, VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB);
+	void initFromImages(BaseProject *bp, VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB, bool initSampler = true);
 	VkDescriptorImageInfo getViewAndSampler();
 	void cleanup();
 };
@@ -285,7 +633,7 @@ struct FrameBufferAttachment {
 	RenderPass *RP;
 	
 	VkImage image;
-	VkDeviceMemory mem;
+	GPUAllocation mem;
 	VkImageView view;
 	AttachmentProperties *properties;
 	
@@ -339,11 +687,23 @@ struct RenderPass {
 	std::vector<VkClearValue> clearValues;
 
 	VkRenderPass renderPass;
+	
+	// used to label the pass in the GPU profiler
+	std::string name;
+	int profScope = -1;
+	int profImage = 0;
+	
+	// When true, the content of the pass is recorded in secondary command
+	// buffers (see Scene::populateCommandBuffer()), executed by end()
+	bool secondaryContents = false;
+	std::vector<VkCommandBuffer> pendingSecondary;
 
   	void init(BaseProject *bp, int w = -1, int h = -1, int _count = -1, std::vector <AttachmentProperties> *p = nullptr, std::vector<VkSubpassDependency> *d = nullptr, bool initSampler = false);
 	void create();
 	void begin(VkCommandBuffer commandBuffer, int currentImage);
 	void end(VkCommandBuffer commandBuffer);
+	void addSecondary(VkCommandBuffer commandBuffer);
+	VkCommandBufferInheritanceInfo getInheritanceInfo(int currentImage);
 	void cleanup();
 	void destroy();
 	static std::vector <AttachmentProperties> *getStandardAttchmentsProperties(StockAttchmentsConfiguration cfg, BaseProject *BP);
@@ -392,25 +752,62 @@ struct Pipeline {
 struct DescriptorSet {
 	BaseProject *BP;
 
-	std::vector<std::vector<VkBuffer>> uniformBuffers;
-	std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemory;
-	std::vector<VkDescriptorSet> descriptorSets;
+	// one slot of the uniform ring for each uniform binding
+	std::vector<UniformSlot> uniformSlots;
+	int dynamicOffsetCount = 0;
+	static const int maxDynamicOffsets = 16;
+	// shared by all the swap chain images
+	VkDescriptorSet descriptorSet;
 	DescriptorSetLayout *Layout;
-	
-	std::vector<bool> toFree;
 
 	void init(BaseProject *bp, DescriptorSetLayout *L,
 						 std::vector<VkDescriptorImageInfo>VaSs);
 	void cleanup();
   	void bind(VkCommandBuffer commandBuffer, Pipeline &P, int setId, int currentImage);
   	void map(int currentImage, void *src, int slot);
+	
+	// The uniform slots stay mapped for the whole life of the set, so they
+	// can be written in place. The memory may be write-combined: write the
+	// fields, but never read them back.
+	void *getMapped(int currentImage, int slot = 0);
+	template <class T>
+	T *get(int currentImage, int slot = 0) {
+		if(sizeof(T) > static_cast<size_t>(Layout->Bindings[slot].linkSize)) {
+			throw std::runtime_error("uniform type larger than its binding!");
+		}
+		return static_cast<T *>(getMapped(currentImage, slot));
+	}
 };
 
 
-struct PoolSizes {
-	int uniformBlocksInPool = 0;
-	int texturesInPool = 0;
-	int setsInPool = 0;
+// Descriptor sets are allocated from a chain of pools: when the current
+// pool runs out of space a new one is added, so nothing has to be sized
+// in advance. Sets are never freed one by one: reset() gives all of them
+// back at once, and keeps the pools to be reused.
+struct DescriptorAllocator {
+	BaseProject *BP;
+	static const uint32_t setsPerPool = 128;
+	// average descriptors of each type per set, used to size the pools
+	static const uint32_t uniformsPerSet = 2;
+	static const uint32_t samplersPerSet = 4;
+	
+	VkDescriptorPool currentPool = VK_NULL_HANDLE;
+	std::vector<VkDescriptorPool> fullPools;
+	std::vector<VkDescriptorPool> freePools;
+	
+	// usage since the last reset, and peaks
+	int sets = 0;
+	int uniformDescriptors = 0;
+	int samplerDescriptors = 0;
+	int peakSets = 0;
+	int poolCount = 0;
+	
+	void init(BaseProject *bp);
+	void cleanup();
+	VkDescriptorSet allocate(DescriptorSetLayout *DSL);
+	void reset();
+	void printStats(std::string name);
+	VkDescriptorPool nextPool();
 };
 
 typedef void (* pNCBfunc)(VkCommandBuffer commandBuffer, int i, void *params);
@@ -421,18 +818,188 @@ enum NamedCommandBuffersStates {NCBS_SUBMITTED, NCBS_IN_CREATION, NCBS_IN_USE, N
 struct NamedCommandBuffer {
 	std::string name;
 	int order;
-	std::vector<VkCommandBuffer *> cb;
+	std::vector<VkCommandBuffer> cb;
 	pNCBfunc filler;
 	pNCBfree cleaner;
 	void *params;
 
 	NamedCommandBuffersStates state;
 	std::vector<bool> inQueue;
+	int inQueueCount;
+};
+
+// Command buffers of one swap chain image. Released buffers go back to the
+// free list and are reset when they are recorded again, so resubmitting a
+// named command buffer does not allocate anything in the steady state.
+struct ImageCommandPool {
+	VkCommandPool pool;
+	std::vector<VkCommandBuffer> freeBuffers;
+	int allocated;
 };
 
-struct NamedCommandBufferVersions {
-	NamedCommandBuffer *current;
-	std::vector<NamedCommandBuffer *>old;
+enum InputCaptureMode {ICM_LIVE, ICM_RECORD, ICM_REPLAY};
+
+// One frame of user input, as seen by getSixAxis() and getKey().
+// Input files are a 4 bytes header ("INP1") followed by these records.
+struct InputFrame {
+	float deltaT;
+	float m[3];
+	float r[3];
+	uint8_t fire;
+	uint8_t keys[GLFW_KEY_LAST + 1];
+};
+
+struct GPUProfilerScope {
+	std::string name;
+	float lastMs;
+	float totalMs;
+	int samples;
+};
+
+struct GPUProfilerEvent {
+	int scope;
+	int frame;
+	double startUs;
+	double durUs;
+};
+
+// GPU timestamp profiler. Each swap chain image has its own region of the
+// query pool, reset at the beginning of every submission, and read back
+// only when the image is reused (after its fence has been waited), so
+// collecting the results never stalls the CPU.
+struct GPUProfiler {
+	BaseProject *BP;
+	bool enabled = false;
+	bool active = false;
+	std::string traceFile;
+	
+	static const int maxScopes = 64;
+	static const int maxEvents = 200000;
+	
+	VkQueryPool queryPool = VK_NULL_HANDLE;
+	int imageCount = 0;
+	float timestampPeriod = 1.0f;
+	uint64_t timestampMask = ~0ull;
+	std::vector<VkCommandBuffer> resetCommandBuffers;
+	std::vector<bool> pending;
+	
+	std::vector<GPUProfilerScope> scopes;
+	std::unordered_map<std::string, int> scopeIds;
+	std::vector<GPUProfilerEvent> events;
+	uint64_t firstTimestamp = 0;
+	bool hasFirstTimestamp = false;
+	int frame = 0;
+	
+	void init(BaseProject *bp);
+	void create();
+	void cleanup();
+	int registerScope(std::string name);
+	int beginScope(VkCommandBuffer commandBuffer, int currentImage, std::string name);
+	void beginScope(VkCommandBuffer commandBuffer, int currentImage, int scope);
+	void endScope(VkCommandBuffer commandBuffer, int currentImage, int scope);
+	void markSubmitted(int currentImage);
+	void collect(int currentImage);
+	float getScopeMs(std::string name);
+	float getScopeAverageMs(std::string name);
+	void printReport();
+	void dumpChromeTrace(std::string file);
+};
+
+// FTP_FENCE is the time the CPU waited for the GPU, FTP_GPU_IDLE is not a
+// CPU phase but the time the GPU had no work, waiting for the CPU to submit
+enum FrameTimerPhase {FTP_FENCE, FTP_ACQUIRE, FTP_UPDATE_UNIFORM, FTP_UPDATE_CB,
+					  FTP_SUBMIT, FTP_PRESENT, FTP_GPU_IDLE, FTP_TOTAL, FTP_COUNT};
+
+struct FrameTimerSample {
+	float ms[FTP_COUNT];
+};
+
+// CPU time spent in the phases of drawFrame(). The last ringSize frames are
+// kept in a ring buffer, and a log2 histogram (binsPerOctave bins per octave,
+// starting from 1us) of the same frames gives the rolling percentiles.
+// drawFrame() is the only writer: readers on other threads never lock, they
+// simply see the histogram of a frame more or a frame less.
+struct FrameTimer {
+	static const int ringSize = 512;
+	static const int binsPerOctave = 8;
+	static const int numBins = 20 * binsPerOctave;
+	static const char *phaseNames[FTP_COUNT];
+	
+	FrameTimerSample ring[ringSize];
+	std::atomic<uint32_t> written{0};
+	std::atomic<uint32_t> hist[FTP_COUNT][numBins];
+	
+	FrameTimerSample cur;
+	std::chrono::high_resolution_clock::time_point frameStart, phaseStart;
+	
+	FrameTimer();
+	void beginFrame();
+	void stop(FrameTimerPhase phase);
+	void set(FrameTimerPhase phase, float ms);
+	void endFrame();
+	
+	float getLastMs(FrameTimerPhase phase);
+	float getPercentileMs(FrameTimerPhase phase, float q);
+	std::string getReport();
+	
+	static int binOf(float ms);
+};
+
+// Lock-free exchange of the latest value between one writer thread and one
+// reader thread. The writer fills the slot returned by beginWrite() and then
+// publishes it; the reader always gets the most recent complete value.
+// A third slot is required so that neither side ever waits for the other.
+template <class T>
+struct SnapshotBuffer {
+	static const int freshBit = 4;
+	
+	T slots[3];
+	std::atomic<int> middle{1};
+	int writeIdx = 0;
+	int readIdx = 2;
+	
+	T &beginWrite() {
+		return slots[writeIdx];
+	}
+	void publish() {
+		writeIdx = middle.exchange(writeIdx | freshBit, std::memory_order_acq_rel) & 3;
+	}
+	bool hasNew() {
+		return (middle.load(std::memory_order_acquire) & freshBit) != 0;
+	}
+	const T &read() {
+		if(hasNew()) {
+			readIdx = middle.exchange(readIdx, std::memory_order_acq_rel) & 3;
+		}
+		return slots[readIdx];
+	}
+};
+
+// Lock-free FIFO of at most N elements, for one producer and one consumer thread.
+template <class T, int N>
+struct SPSCQueue {
+	T items[N];
+	std::atomic<uint32_t> head{0};
+	std::atomic<uint32_t> tail{0};
+	
+	bool push(const T &v) {
+		uint32_t h = head.load(std::memory_order_relaxed);
+		if(h - tail.load(std::memory_order_acquire) >= N) {
+			return false;
+		}
+		items[h % N] = v;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+	bool pop(T &v) {
+		uint32_t t = tail.load(std::memory_order_relaxed);
+		if(t == head.load(std::memory_order_acquire)) {
+			return false;
+		}
+		v = items[t % N];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
 };
 
 // MAIN ! 
@@ -445,12 +1012,44 @@ class BaseProject {
 	friend class Pipeline;
 	friend class DescriptorSetLayout;
 	friend class DescriptorSet;
+	friend struct GPUProfiler;
+	friend struct GPUMemoryAllocator;
+	friend struct StagingUploader;
+	friend struct UniformRing;
+	friend struct DescriptorAllocator;
+	friend class Scene;
 
 public:
 	virtual void setWindowParameters() = 0;
-    void run(); 
-
-	PoolSizes DPSZs;
+    void run(int headlessFrameCount = 0); 
+
+	// Input capture: must be called before run()
+	void recordInput(std::string file);
+	void replayInput(std::string file, float fixedDeltaT = 1.0f / 60.0f);
+
+	// Presentation settings: must be called before run()
+	void setFramesInFlight(int n);
+	void setPresentMode(VkPresentModeKHR mode);
+	void setSwapChainImageCount(int n);
+
+	GPUProfiler gpuProfiler;
+	FrameTimer frameTimer;
+	GPUMemoryAllocator memoryAllocator;
+	StagingUploader stagingUploader;
+	UniformRing uniformRing;
+	DescriptorAllocator descriptorAllocator;
+	HostAllocator hostAllocator;
+	AssetRegistry assetRegistry;
+	// passed to every create and destroy call: when still null at
+	// initialization, the callbacks of hostAllocator are used
+	const VkAllocationCallbacks *allocationCallbacks = nullptr;
+	
+	// when true, run() times updateCommandBuffers() instead of rendering
+	bool commandBufferBenchmark = false;
+	
+	// Directory of the cooked glTF/MGCG meshes, keyed by the hash of the
+	// source file and of the vertex layout. Empty to always parse the files.
+	std::string meshCacheDir = "cache";
 
 protected:
 	uint32_t windowWidth;
@@ -469,7 +1068,16 @@ protected:
     VkQueue presentQueue;
 	VkCommandPool commandPool;
 	
-	std::unordered_map<std::string, NamedCommandBufferVersions> namedCommandBuffers = {};
+	// current version of each named command buffer, and the same buffers
+	// sorted by order, rebuilt only when the set changes
+	std::unordered_map<std::string, NamedCommandBuffer *> namedCommandBuffers = {};
+	std::vector<NamedCommandBuffer *> submissionList;
+	bool submissionListDirty = false;
+	// replaced or removed versions, still used by some image
+	std::vector<NamedCommandBuffer *> retiringCommandBuffers;
+	// command buffers submitted in the current frame
+	std::vector<VkCommandBuffer> frameCommandBuffers;
+	std::vector<ImageCommandPool> imageCommandPools;
 	
 	VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
 	
@@ -478,19 +1086,48 @@ protected:
 	VkFormat swapChainImageFormat;
 	VkExtent2D swapChainExtent;
 	std::vector<VkImageView> swapChainImageViews;
-		
- 	VkDescriptorPool descriptorPool;
+
 
 	VkDebugUtilsMessengerEXT debugMessenger;
 
 	size_t currentFrame = 0;
 	bool framebufferResized = false;
 
+	// Headless mode: frames are rendered into offscreen images
+	// that replace the swap chain, without window and surface
+	bool headless = false;
+	int headlessFrames = 0;
+	uint32_t headlessImageIndex = 0;
+	std::vector<GPUAllocation> headlessImagesMemory;
+
+	// Input record / replay
+	InputCaptureMode inputMode = ICM_LIVE;
+	std::string inputFileName;
+	std::ofstream inputRecordFile;
+	std::vector<InputFrame> inputReplayFrames;
+	int inputReplayPos = 0;
+	float inputReplayDeltaT = 0.0f;
+	bool inputReplayDone = false;
+	InputFrame curInputFrame;
+	std::vector<float> replayFrameTimes;
+
 	std::vector<VkSemaphore> imageAvailableSemaphores;
 	std::vector<VkSemaphore> renderFinishedSemaphores;
 	std::vector<VkFence> inFlightFences;
 	std::vector<VkFence> imagesInFlight;
 	
+	// Frame pacing with a timeline semaphore: frame n signals value n.
+	// Without timeline semaphores, the fences above are used instead.
+	bool useTimeline = false;
+	bool memoryBudgetEnabled = false;
+	VkSemaphore frameTimeline = VK_NULL_HANDLE;
+	uint64_t frameCounter = 0;
+	std::vector<uint64_t> imageFrameValue;
+	
+	int framesInFlight = 2;
+	VkPresentModeKHR preferredPresentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+	uint32_t requestedImageCount = 0;	// 0 = one more than the minimum
+	
     void initWindow();
 
 	virtual void onWindowResize(int w, int h) = 0;
@@ -535,6 +1172,7 @@ protected:
 	VkSampleCountFlagBits getMaxUsableSampleCount();
 	void createLogicalDevice();
 	void createSwapChain();
+	void createHeadlessImages();
 	VkSurfaceFormatKHR chooseSwapSurfaceFormat(
 			const std::vector<VkSurfaceFormatKHR>& availableFormats);
 	VkPresentModeKHR chooseSwapPresentMode(
@@ -557,7 +1195,8 @@ protected:
 				 VkImageTiling tiling, VkImageUsageFlags usage,
 				 VkImageCreateFlags cflags,
 				 VkMemoryPropertyFlags properties, VkImage& image,
-				 VkDeviceMemory& imageMemory);	
+				 GPUAllocation& imageMemory,
+				 GPUMemoryTag tag = GMT_OTHER, GPUMemoryLifetime lifetime = GML_STATIC);	
 	void generateMipmaps(VkImage image, VkFormat imageFormat,
 					 int32_t texWidth, int32_t texHeight,
 					 uint32_t mipLevels, int layerCount);
@@ -570,25 +1209,34 @@ protected:
 	void endSingleTimeCommands(VkCommandBuffer commandBuffer);
 	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 				  VkMemoryPropertyFlags properties,
-				  VkBuffer& buffer, VkDeviceMemory& bufferMemory);
+				  VkBuffer& buffer, GPUAllocation& bufferMemory,
+				  GPUMemoryTag tag = GMT_OTHER, GPUMemoryLifetime lifetime = GML_STATIC);
 	uint32_t findMemoryType(uint32_t typeFilter,
 						VkMemoryPropertyFlags properties);
-	void createDescriptorPool();
 						
 	public:
 	void submitCommandBuffer(std::string name, int order, pNCBfunc populateNewCommandBuffer, void *params, pNCBfree onErase = nullptr);
 
 	protected:
 	void removeBuffer(std::string name);
+	void retireNamedCommandBuffer(NamedCommandBuffer *ncb);
 	void clearNamedCommandBufferForImage(NamedCommandBuffer *ncb, int img);
 	void clearNamedCommandBuffer(NamedCommandBuffer *ncb);
 	void clearCommandBuffers();
 	void resetCommandBuffers();
+	void createImageCommandPools();
+	void destroyImageCommandPools();
+	VkCommandBuffer acquireCommandBuffer(int img);
+	void releaseCommandBuffer(int img, VkCommandBuffer cb);
 	void createSyncObjects();
 	void mainLoop();
+	void headlessLoop();
 	void createCommandBuffer(NamedCommandBuffer *ncb, int imageIndex);
 	void updateCommandBuffers(std::vector<VkCommandBuffer> &buffers, int imageIndex);
+	void benchmarkCommandBuffers();
 	void drawFrame();
+	void waitForFrame(uint64_t frameValue);
+	bool isPreviousFrameComplete(uint64_t frameValue);
 	
 	virtual void updateUniformBuffer(uint32_t currentImage) = 0;
 	virtual void pipelinesAndDescriptorSetsCleanup() = 0;
@@ -600,11 +1248,21 @@ protected:
 	void RebuildPipeline();
 	
 	// Control Wrapper
+	int getKey(int key);
 	void handleGamePad(int id,  glm::vec3 &m, glm::vec3 &r, bool &fire);
 	void getSixAxis(float &deltaT,
 				glm::vec3 &m,
 				glm::vec3 &r,
 				bool &fire);
+	void pollSixAxis(float &deltaT,
+				glm::vec3 &m,
+				glm::vec3 &r,
+				bool &fire);
+	void openInputCapture();
+	void closeInputCapture();
+	void inputBeginFrame();
+	void inputEndFrame();
+	void printReplayStats();
 	
 	// Public part of the base class
 	public:
@@ -764,16 +1422,92 @@ std::vector<char> readFile(const std::string& filename) {
 	return buffer;
 }
 
+uint64_t hashBytes(const void *data, size_t size, uint64_t key) {
+	// FNV-1a
+	const unsigned char *bytes = static_cast<const unsigned char *>(data);
+	for(size_t i = 0; i < size; i++) {
+		key = (key ^ bytes[i]) * 1099511628211ull;
+	}
+	return key;
+}
+
+// MGCG files are AES-CBC encrypted, deflated glTF files
+std::vector<char> decodeMGCG(const std::vector<char> &encoded) {
+	const std::vector<unsigned char> key = plusaes::key_from_string(&"CG2023SkelKey128"); // 16-char = 128-bit
+	const unsigned char iv[16] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+	};
+
+	// decrypt
+	unsigned long padded_size = 0;
+	std::vector<unsigned char> decrypted(encoded.size());
+
+	plusaes::decrypt_cbc((unsigned char*)encoded.data(), encoded.size(), &key[0], key.size(), &iv, &decrypted[0], decrypted.size(), &padded_size);
+
+	int size = 0;
+	sscanf(reinterpret_cast<char *const>(&decrypted[0]), "%d", &size);
+//std::cout << decrypted.size() << ", decomp: " << size << "\n";
+
+	std::vector<char> decomp(size);
+	int n = sinflate(decomp.data(), (int)size, &decrypted[16], decrypted.size()-16);
+	return decomp;
+}
+
 // BaseProject class members
 
-void BaseProject::run() {
+void BaseProject::run(int headlessFrameCount) {
 	windowResizable = GLFW_FALSE;
+	headless = headlessFrameCount > 0;
+	headlessFrames = headlessFrameCount;
 
 	setWindowParameters();
-	initWindow();
+	if(headless) {
+		window = nullptr;
+	} else {
+		initWindow();
+	}
+	openInputCapture();
 	initVulkan();
-	mainLoop();
+	if(commandBufferBenchmark) {
+		benchmarkCommandBuffers();
+	} else if(headless) {
+		headlessLoop();
+	} else {
+		mainLoop();
+	}
+	closeInputCapture();
 	cleanup();
+	
+	if(gpuProfiler.active) {
+		gpuProfiler.printReport();
+		if(!gpuProfiler.traceFile.empty()) {
+			gpuProfiler.dumpChromeTrace(gpuProfiler.traceFile);
+		}
+	}
+}
+
+void BaseProject::recordInput(std::string file) {
+	inputMode = ICM_RECORD;
+	inputFileName = file;
+}
+
+void BaseProject::replayInput(std::string file, float fixedDeltaT) {
+	inputMode = ICM_REPLAY;
+	inputFileName = file;
+	inputReplayDeltaT = fixedDeltaT;
+}
+
+void BaseProject::setFramesInFlight(int n) {
+	framesInFlight = std::clamp(n, 1, MAX_FRAMES_IN_FLIGHT);
+}
+
+void BaseProject::setPresentMode(VkPresentModeKHR mode) {
+	preferredPresentMode = mode;
+}
+
+void BaseProject::setSwapChainImageCount(int n) {
+	requestedImageCount = n > 0 ? n : 0;
 }
 
 void BaseProject::initWindow() {
@@ -797,22 +1531,38 @@ void BaseProject::framebufferResizeCallback(GLFWwindow* window, int width, int h
 }
 
 void BaseProject::initVulkan() {
+	if(allocationCallbacks == nullptr) {
+		allocationCallbacks = hostAllocator.init();
+	}
 	createInstance();				
 	setupDebugMessenger();			
-	createSurface();				
+	if(!headless) {
+		createSurface();				
+	}
 	pickPhysicalDevice();			
 	createLogicalDevice();			
-	createSwapChain();				
+	memoryAllocator.init(this);
+	if(headless) {
+		createHeadlessImages();
+	} else {
+		createSwapChain();				
+	}
 	createImageViews();				
 
 	createCommandPool();			
+	createImageCommandPools();
+	stagingUploader.init(this);
+	uniformRing.init(this, swapChainImages.size());
+	descriptorAllocator.init(this);
 	localInit();
 
-	createDescriptorPool();			
 	pipelinesAndDescriptorSetsInit();
 
 //		createCommandBuffers();			
 	createSyncObjects();			 
+	
+	gpuProfiler.init(this);
+	memoryAllocator.trackSwapChainMemory();
 }
 
 void BaseProject::createInstance() {
@@ -823,15 +1573,15 @@ std::cout << "Starting createInstance()\n"  << std::flush;
 	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
 	appInfo.pEngineName = "No Engine";
 	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-	appInfo.apiVersion = VK_API_VERSION_1_0;
+	appInfo.apiVersion = VK_API_VERSION_1_2;
 	
 	VkInstanceCreateInfo createInfo{};
 	createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
 	createInfo.pApplicationInfo = &appInfo;
 
-	uint32_t glfwExtensionCount = 0;
-	const char** glfwExtensions;
-	glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+//		uint32_t glfwExtensionCount = 0;
+//		const char** glfwExtensions;
+//		glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
 			
 //		createInfo.enabledExtensionCount = glfwExtensionCount;
 //		createInfo.ppEnabledExtensionNames = glfwExtensions;
@@ -858,7 +1608,7 @@ std::cout << "Starting createInstance()\n"  << std::flush;
 		createInfo.pNext = (VkDebugUtilsMessengerCreateInfoEXT*)
 								&debugCreateInfo;
 	
-	VkResult result = vkCreateInstance(&createInfo, nullptr, &instance);
+	VkResult result = vkCreateInstance(&createInfo, allocationCallbacks, &instance);
 	
 	if(result != VK_SUCCESS) {
 		PrintVkError(result);
@@ -868,9 +1618,12 @@ std::cout << "Starting createInstance()\n"  << std::flush;
 
 std::vector<const char*> BaseProject::getRequiredExtensions() {
 	uint32_t glfwExtensionCount = 0;
-	const char** glfwExtensions;
-	glfwExtensions =
-		glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+	const char** glfwExtensions = nullptr;
+	// without a window, the surface extensions are not needed
+	if(!headless) {
+		glfwExtensions =
+			glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+	}
 
 	std::vector<const char*> extensions(glfwExtensions,
 		glfwExtensions + glfwExtensionCount);
@@ -981,14 +1734,14 @@ void BaseProject::setupDebugMessenger() {
 	VkDebugUtilsMessengerCreateInfoEXT createInfo{};
 	populateDebugMessengerCreateInfo(createInfo);
 	
-	if (CreateDebugUtilsMessengerEXT(instance, &createInfo, nullptr,
+	if (CreateDebugUtilsMessengerEXT(instance, &createInfo, allocationCallbacks,
 			&debugMessenger) != VK_SUCCESS) {
 		throw std::runtime_error("failed to set up debug messenger!");
 	}
 }
 
 void BaseProject::createSurface() {
-	if (glfwCreateWindowSurface(instance, window, nullptr, &surface)
+	if (glfwCreateWindowSurface(instance, window, allocationCallbacks, &surface)
 			!= VK_SUCCESS) {
 		throw std::runtime_error("failed to create window surface!");
 	}
@@ -1049,7 +1802,10 @@ bool BaseProject::isDeviceSuitable(VkPhysicalDevice device, deviceReport &devRep
 	devRep.extensionsSupported = checkDeviceExtensionSupport(device, devRep);
 
 	devRep.swapChainAdequate = false;
-	if (devRep.extensionsSupported) {
+	if (headless) {
+		// no surface to present to: the offscreen images are always adequate
+		devRep.swapChainAdequate = true;
+	} else if (devRep.extensionsSupported) {
 		SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
 		devRep.swapChainFormatSupport = swapChainSupport.formats.empty();
 		devRep.swapChainPresentModeSupport = swapChainSupport.presentModes.empty();
@@ -1085,7 +1841,12 @@ QueueFamilyIndices BaseProject::findQueueFamilies(VkPhysicalDevice device) {
 		}
 			
 		VkBool32 presentSupport = false;
-		vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+		if (headless) {
+			// nothing is presented: the graphics queue plays both roles
+			presentSupport = (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+		} else {
+			vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+		}
 		if (presentSupport) {
 			indices.presentFamily = i;
 		}
@@ -1188,8 +1949,40 @@ void BaseProject::createLogicalDevice() {
 	deviceFeatures.sampleRateShading = VK_TRUE;
 	deviceFeatures.fillModeNonSolid  = VK_TRUE;
 	
+	// timeline semaphores (core in Vulkan 1.2) for the frame pacing
+	VkPhysicalDeviceProperties deviceProperties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+	VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures{};
+	timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+	if (deviceProperties.apiVersion >= VK_API_VERSION_1_2) {
+		VkPhysicalDeviceFeatures2 features2{};
+		features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		features2.pNext = &timelineFeatures;
+		vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+	}
+	useTimeline = (timelineFeatures.timelineSemaphore == VK_TRUE);
+	std::cout << "Frame pacing with " << (useTimeline ? "timeline semaphore" : "fences") << "\n";
+	
+	// memory budget queries, used by the memory report when available
+	std::vector<const char*> enabledExtensions = deviceExtensions;
+	uint32_t extensionCount;
+	vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr,
+				&extensionCount, nullptr);
+	std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+	vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr,
+				&extensionCount, availableExtensions.data());
+	memoryBudgetEnabled = false;
+	for (const auto& extension : availableExtensions) {
+		if (strcmp(extension.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0) {
+			enabledExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+			memoryBudgetEnabled = true;
+			break;
+		}
+	}
+	
 	VkDeviceCreateInfo createInfo{};
 	createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+	createInfo.pNext = useTimeline ? &timelineFeatures : nullptr;
 	
 	createInfo.pQueueCreateInfos = queueCreateInfos.data();
 	createInfo.queueCreateInfoCount = 
@@ -1197,14 +1990,14 @@ void BaseProject::createLogicalDevice() {
 	
 	createInfo.pEnabledFeatures = &deviceFeatures;
 	createInfo.enabledExtensionCount =
-			static_cast<uint32_t>(deviceExtensions.size());
-	createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+			static_cast<uint32_t>(enabledExtensions.size());
+	createInfo.ppEnabledExtensionNames = enabledExtensions.data();
 
 		createInfo.enabledLayerCount = 
 				static_cast<uint32_t>(validationLayers.size());
 		createInfo.ppEnabledLayerNames = validationLayers.data();
 	
-	VkResult result = vkCreateDevice(physicalDevice, &createInfo, nullptr, &device);
+	VkResult result = vkCreateDevice(physicalDevice, &createInfo, allocationCallbacks, &device);
 	
 	if (result != VK_SUCCESS) {
 		PrintVkError(result);
@@ -1225,6 +2018,10 @@ void BaseProject::createSwapChain() {
 	VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
 	
 	uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;
+	if (requestedImageCount > 0) {
+		imageCount = std::max(requestedImageCount,
+							  swapChainSupport.capabilities.minImageCount);
+	}
 	
 	if (swapChainSupport.capabilities.maxImageCount > 0 &&
 			imageCount > swapChainSupport.capabilities.maxImageCount) {
@@ -1261,7 +2058,7 @@ void BaseProject::createSwapChain() {
 	 createInfo.clipped = VK_TRUE;
 	 createInfo.oldSwapchain = VK_NULL_HANDLE;
 	 
-	 VkResult result = vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain);
+	 VkResult result = vkCreateSwapchainKHR(device, &createInfo, allocationCallbacks, &swapChain);
 	 if (result != VK_SUCCESS) {
 		PrintVkError(result);
 		throw std::runtime_error("failed to create swap chain!");
@@ -1276,6 +2073,37 @@ void BaseProject::createSwapChain() {
 	swapChainExtent = extent;
 }
 
+void BaseProject::createHeadlessImages() {
+	// the offscreen images take the role of the swap chain images,
+	// so render passes with swapChain attachments work unchanged
+	// there is no surface to bound the request: at most 8 images, as
+	// a typical maxImageCount
+	const uint32_t maxHeadlessImages = 8;
+	uint32_t imageCount = requestedImageCount > 0 ? requestedImageCount : 3;
+	if (imageCount > maxHeadlessImages) {
+		std::cout << "Headless mode: " << imageCount << " images requested, using "
+				  << maxHeadlessImages << "\n";
+		imageCount = maxHeadlessImages;
+	}
+	
+	swapChainImageFormat = VK_FORMAT_B8G8R8A8_SRGB;
+	swapChainExtent = {windowWidth, windowHeight};
+	
+	swapChainImages.resize(imageCount);
+	headlessImagesMemory.resize(imageCount);
+	for (uint32_t i = 0; i < imageCount; i++) {
+		createImage(swapChainExtent.width, swapChainExtent.height, 1, 1,
+					VK_SAMPLE_COUNT_1_BIT, swapChainImageFormat,
+					VK_IMAGE_TILING_OPTIMAL,
+					VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+					VK_IMAGE_USAGE_TRANSFER_SRC_BIT, 0,
+					VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+					swapChainImages[i], headlessImagesMemory[i],
+					GMT_ATTACHMENT, GML_SWAPCHAIN);
+	}
+	headlessImageIndex = 0;
+}
+
 VkSurfaceFormatKHR BaseProject::chooseSwapSurfaceFormat(
 			const std::vector<VkSurfaceFormatKHR>& availableFormats)
 {
@@ -1292,10 +2120,14 @@ VkSurfaceFormatKHR BaseProject::chooseSwapSurfaceFormat(
 VkPresentModeKHR BaseProject::chooseSwapPresentMode(
 		const std::vector<VkPresentModeKHR>& availablePresentModes) {
 	for (const auto& availablePresentMode : availablePresentModes) {
-		if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
+		if (availablePresentMode == preferredPresentMode) {
 			return availablePresentMode;
 		}
 	}
+	// FIFO is the only mode that is always supported
+	if (preferredPresentMode != VK_PRESENT_MODE_MAILBOX_KHR) {
+		std::cout << "Present mode " << preferredPresentMode << " not supported, using FIFO\n";
+	}
 	return VK_PRESENT_MODE_FIFO_KHR;
 }
 
@@ -1342,7 +2174,7 @@ VkImageView BaseProject::createImageView(VkImage image, VkFormat format,
 	viewInfo.subresourceRange.layerCount = layerCount;
 	VkImageView imageView;
 
-	VkResult result = vkCreateImageView(device, &viewInfo, nullptr,
+	VkResult result = vkCreateImageView(device, &viewInfo, allocationCallbacks,
 			&imageView);
 	if (result != VK_SUCCESS) {
 		PrintVkError(result);
@@ -1362,7 +2194,7 @@ void BaseProject::createCommandPool() {
 	poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
 	poolInfo.flags = 0; // Optional
 	
-	VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool);
+	VkResult result = vkCreateCommandPool(device, &poolInfo, allocationCallbacks, &commandPool);
 	if (result != VK_SUCCESS) {
 		PrintVkError(result);
 		throw std::runtime_error("failed to create command pool!");
@@ -1408,7 +2240,8 @@ void BaseProject::createImage(uint32_t width, uint32_t height,
 				 VkImageTiling tiling, VkImageUsageFlags usage,
 				 VkImageCreateFlags cflags,
 				 VkMemoryPropertyFlags properties, VkImage& image,
-				 VkDeviceMemory& imageMemory) {		
+				 GPUAllocation& imageMemory,
+				 GPUMemoryTag tag, GPUMemoryLifetime lifetime) {		
 	VkImageCreateInfo imageInfo{};
 	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 	imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1425,7 +2258,7 @@ void BaseProject::createImage(uint32_t width, uint32_t height,
 	imageInfo.samples = numSamples;
 	imageInfo.flags = cflags; 
 	
-	VkResult result = vkCreateImage(device, &imageInfo, nullptr, &image);
+	VkResult result = vkCreateImage(device, &imageInfo, allocationCallbacks, &image);
 	if (result != VK_SUCCESS) {
 		PrintVkError(result);
 		throw std::runtime_error("failed to create image!");
@@ -1434,17 +2267,10 @@ void BaseProject::createImage(uint32_t width, uint32_t height,
 	VkMemoryRequirements memRequirements;
 	vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits,
-										properties);
-	if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) !=
-							VK_SUCCESS) {
-		throw std::runtime_error("failed to allocate image memory!");
-	}
+	imageMemory = memoryAllocator.allocate(memRequirements, properties,
+										tiling == VK_IMAGE_TILING_OPTIMAL, tag, lifetime);
 
-	vkBindImageMemory(device, image, imageMemory, 0);
+	vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
 }
 
 void BaseProject::generateMipmaps(VkImage image, VkFormat imageFormat,
@@ -1650,7 +2476,8 @@ void BaseProject::endSingleTimeCommands(VkCommandBuffer commandBuffer) {
 
 void BaseProject::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 				  VkMemoryPropertyFlags properties,
-				  VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+				  VkBuffer& buffer, GPUAllocation& bufferMemory,
+				  GPUMemoryTag tag, GPUMemoryLifetime lifetime) {
 	VkBufferCreateInfo bufferInfo{};
 	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 	bufferInfo.size = size;
@@ -1658,7 +2485,7 @@ void BaseProject::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 	
 	VkResult result =
-			vkCreateBuffer(device, &bufferInfo, nullptr, &buffer);
+			vkCreateBuffer(device, &bufferInfo, allocationCallbacks, &buffer);
 	if (result != VK_SUCCESS) {
 		PrintVkError(result);
 		throw std::runtime_error("failed to create vertex buffer!");
@@ -1667,20 +2494,9 @@ void BaseProject::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 	VkMemoryRequirements memRequirements;
 	vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 	
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex =
-			findMemoryType(memRequirements.memoryTypeBits, properties);
-
-	result = vkAllocateMemory(device, &allocInfo, nullptr,
-			&bufferMemory);
-	if (result != VK_SUCCESS) {
-		PrintVkError(result);
-		throw std::runtime_error("failed to allocate vertex buffer memory!");
-	}
+	bufferMemory = memoryAllocator.allocate(memRequirements, properties, false, tag, lifetime);
 	
-	vkBindBufferMemory(device, buffer, bufferMemory, 0);
+	vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);
 }
 
 uint32_t BaseProject::findMemoryType(uint32_t typeFilter,
@@ -1699,78 +2515,56 @@ uint32_t BaseProject::findMemoryType(uint32_t typeFilter,
 	throw std::runtime_error("failed to find suitable memory type!");
 }
 
-void BaseProject::createDescriptorPool() {
-	std::array<VkDescriptorPoolSize, 2> poolSizes{};
-	poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	poolSizes[0].descriptorCount = static_cast<uint32_t>(DPSZs.uniformBlocksInPool * swapChainImages.size());
-	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-	poolSizes[1].descriptorCount = static_cast<uint32_t>(DPSZs.texturesInPool * swapChainImages.size());
-														 
-	VkDescriptorPoolCreateInfo poolInfo{};
-	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-	poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());;
-	poolInfo.pPoolSizes = poolSizes.data();
-	poolInfo.maxSets = static_cast<uint32_t>(DPSZs.setsInPool * swapChainImages.size());
-	
-	VkResult result = vkCreateDescriptorPool(device, &poolInfo, nullptr,
-								&descriptorPool);
-	if (result != VK_SUCCESS) {
-		PrintVkError(result);
-		throw std::runtime_error("failed to create descriptor pool!");
-	}
-}
-
 void BaseProject::submitCommandBuffer(std::string name, int order, pNCBfunc populateNewCommandBuffer, void *params, pNCBfree onErase) {
 	int sz = swapChainImageViews.size();
 
-	NamedCommandBuffer *nncb = new NamedCommandBuffer{name, order, {}, populateNewCommandBuffer, onErase, params, NCBS_SUBMITTED, {}};
+	NamedCommandBuffer *nncb = new NamedCommandBuffer{name, order, {}, populateNewCommandBuffer, onErase, params, NCBS_SUBMITTED, {}, 0};
 	nncb->cb.resize(sz);
-	nncb->inQueue.resize(sz);
-	for(int i = 0; i < sz; i++) {
-		nncb->inQueue[i] = false;
-	}
+	nncb->inQueue.assign(sz, false);
 
 	auto found = namedCommandBuffers.find(name);
 	if(found != namedCommandBuffers.end()) {
 		// If this named command buffer was already pending,
 		// remove the previous instance
-		found->second.current->state = NCBS_TO_DELETE;
-		found->second.old.push_back(found->second.current);
-		found->second.current = nncb;
-//std::cout << "Existing command buffer '" << name << "', old size: " << found->second.old.size() << "\n";
+		retireNamedCommandBuffer(found->second);
+		found->second = nncb;
+//std::cout << "Existing command buffer '" << name << "', retiring: " << retiringCommandBuffers.size() << "\n";
 	} else {
 		// otherwise, add a new named command buffer
-		namedCommandBuffers[name] = {nncb, {}};
+		namedCommandBuffers[name] = nncb;
 //std::cout << "New command buffer '" << name << "'\n";
 	}
+	submissionListDirty = true;
 }
 
 void BaseProject::removeBuffer(std::string name) {
 	auto found = namedCommandBuffers.find(name);
 	if(found != namedCommandBuffers.end()) {
 		// A command buffer must be found to be removed
-		found->second.current->state = NCBS_TO_DELETE;
-		found->second.old.push_back(found->second.current);
-		found->second.current = nullptr;
+		retireNamedCommandBuffer(found->second);
+		namedCommandBuffers.erase(found);
+		submissionListDirty = true;
 	} else {
 		// just print a warning message
 		std::cout << "Try to delete a non-submitted command buffer: " << name << "\n";
 	}
 }
 
+void BaseProject::retireNamedCommandBuffer(NamedCommandBuffer *ncb) {
+	ncb->state = NCBS_TO_DELETE;
+	retiringCommandBuffers.push_back(ncb);
+}
+
 void BaseProject::clearNamedCommandBufferForImage(NamedCommandBuffer *ncb, int img) {
 	if(ncb->inQueue[img]) {
-		vkFreeCommandBuffers(device, commandPool, 1,
-						 ncb->cb[img]);
-		free(ncb->cb[img]);
+		releaseCommandBuffer(img, ncb->cb[img]);
 		ncb->inQueue[img] = false;
+		ncb->inQueueCount--;
 	}
 }
 
 void BaseProject::clearNamedCommandBuffer(NamedCommandBuffer *ncb) {
-	int sz = swapChainImageViews.size();
-
-	for(int i = 0; i < sz; i++) {
+	for(int i = 0; i < ncb->inQueue.size(); i++) {
 		clearNamedCommandBufferForImage(ncb, i);
 	}
 	if(ncb->cleaner != nullptr) {
@@ -1784,41 +2578,117 @@ void BaseProject::clearNamedCommandBuffer(NamedCommandBuffer *ncb) {
 
 void BaseProject::clearCommandBuffers() {
 	for(auto &v : namedCommandBuffers) {
-		// check it was allocated
-		if(v.second.current != nullptr) {
-			clearNamedCommandBuffer(v.second.current);
-		}
-		for(auto c : v.second.old) {
-			clearNamedCommandBuffer(c);
-		}
+		clearNamedCommandBuffer(v.second);
+	}
+	for(auto c : retiringCommandBuffers) {
+		clearNamedCommandBuffer(c);
 	}
 	namedCommandBuffers.clear();
+	retiringCommandBuffers.clear();
+	submissionList.clear();
+	submissionListDirty = false;
 }
 
+// Called with the device idle, after the swap chain has been recreated
 void BaseProject::resetCommandBuffers() {
 	int sz = swapChainImageViews.size();
 
-	for(auto &v : namedCommandBuffers) {
-		// check it was allocated
-		if(v.second.current != nullptr) {
-			for(int i = 0; i < sz; i++) {
-				if(v.second.current->inQueue[i]) {
-					vkFreeCommandBuffers(device, commandPool, 1,
-									 v.second.current->cb[i]);
-					free(v.second.current->cb[i]);
-					v.second.current->inQueue[i] = false;
-				}
+	// nothing is in flight: old versions can go right away
+	for(auto c : retiringCommandBuffers) {
+		clearNamedCommandBuffer(c);
+	}
+	retiringCommandBuffers.clear();
+
+	// all the buffers are released at once
+	if(imageCommandPools.size() != sz) {
+		destroyImageCommandPools();
+		createImageCommandPools();
+	} else {
+		// the pools survive: their buffers go back to the free lists,
+		// otherwise they would stay allocated until the pools are destroyed
+		for(auto &v : namedCommandBuffers) {
+			for(int i = 0; i < v.second->inQueue.size(); i++) {
+				clearNamedCommandBufferForImage(v.second, i);
 			}
-			v.second.current->state = NCBS_SUBMITTED;
 		}
+		for(auto &icp : imageCommandPools) {
+			vkResetCommandPool(device, icp.pool, 0);
+		}
+	}
+
+	for(auto &v : namedCommandBuffers) {
+		v.second->cb.resize(sz);
+		v.second->inQueue.assign(sz, false);
+		v.second->inQueueCount = 0;
+		v.second->state = NCBS_SUBMITTED;
+	}
+}
+
+void BaseProject::createImageCommandPools() {
+	QueueFamilyIndices queueFamilyIndices = 
+			findQueueFamilies(physicalDevice);
+			
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	
+	imageCommandPools.resize(swapChainImageViews.size());
+	for(auto &icp : imageCommandPools) {
+		VkResult result = vkCreateCommandPool(device, &poolInfo, allocationCallbacks, &icp.pool);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create command pool!");
+		}
+		icp.freeBuffers.clear();
+		icp.allocated = 0;
+	}
+}
+
+void BaseProject::destroyImageCommandPools() {
+	// destroying a pool frees all its command buffers
+	for(auto &icp : imageCommandPools) {
+		vkDestroyCommandPool(device, icp.pool, allocationCallbacks);
+	}
+	imageCommandPools.clear();
+}
+
+VkCommandBuffer BaseProject::acquireCommandBuffer(int img) {
+	ImageCommandPool &icp = imageCommandPools[img];
+	if(!icp.freeBuffers.empty()) {
+		VkCommandBuffer cb = icp.freeBuffers.back();
+		icp.freeBuffers.pop_back();
+		return cb;
+	}
+
+	VkCommandBufferAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.commandPool = icp.pool;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandBufferCount = 1;
+	
+	VkCommandBuffer cb;
+	VkResult result = vkAllocateCommandBuffers(device, &allocInfo, &cb);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate command buffer!");
 	}
+	icp.allocated++;
+//std::cout << "Image " << img << ": " << icp.allocated << " command buffers\n";
+	return cb;
+}
+
+// the buffer must not be in use by the GPU any more
+void BaseProject::releaseCommandBuffer(int img, VkCommandBuffer cb) {
+	imageCommandPools[img].freeBuffers.push_back(cb);
 }
 
 void BaseProject::createSyncObjects() {
-	imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-	renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-	inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+	imageAvailableSemaphores.resize(framesInFlight);
+	renderFinishedSemaphores.resize(framesInFlight);
+	inFlightFences.resize(framesInFlight, VK_NULL_HANDLE);
 	imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
+	imageFrameValue.assign(swapChainImages.size(), 0);
 			
 	VkSemaphoreCreateInfo semaphoreInfo{};
 	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
@@ -1827,12 +2697,32 @@ void BaseProject::createSyncObjects() {
 	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
 	fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 	
-	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-		VkResult result1 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+	if (useTimeline) {
+		VkSemaphoreTypeCreateInfo typeInfo{};
+		typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+		typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+		typeInfo.initialValue = 0;
+		
+		VkSemaphoreCreateInfo timelineInfo{};
+		timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		timelineInfo.pNext = &typeInfo;
+		
+		VkResult result = vkCreateSemaphore(device, &timelineInfo, allocationCallbacks,
+							&frameTimeline);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create timeline semaphore!");
+		}
+		frameCounter = 0;
+	}
+	
+	for (size_t i = 0; i < framesInFlight; i++) {
+		VkResult result1 = vkCreateSemaphore(device, &semaphoreInfo, allocationCallbacks,
 							&imageAvailableSemaphores[i]);
-		VkResult result2 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+		VkResult result2 = vkCreateSemaphore(device, &semaphoreInfo, allocationCallbacks,
 							&renderFinishedSemaphores[i]);
-		VkResult result3 = vkCreateFence(device, &fenceInfo, nullptr,
+		VkResult result3 = useTimeline ? VK_SUCCESS :
+							vkCreateFence(device, &fenceInfo, allocationCallbacks,
 							&inFlightFences[i]);
 		if (result1 != VK_SUCCESS ||
 			result2 != VK_SUCCESS ||
@@ -1846,33 +2736,55 @@ void BaseProject::createSyncObjects() {
 }
 
 void BaseProject::mainLoop() {
-	while (!glfwWindowShouldClose(window)){
+	while (!glfwWindowShouldClose(window) && !inputReplayDone){
 		glfwPollEvents();
+		auto frameStart = std::chrono::high_resolution_clock::now();
+		drawFrame();
+		if (inputMode == ICM_REPLAY) {
+			auto frameEnd = std::chrono::high_resolution_clock::now();
+			replayFrameTimes.push_back(std::chrono::duration<float, std::chrono::milliseconds::period>
+					(frameEnd - frameStart).count());
+		}
+	}
+	
+	vkDeviceWaitIdle(device);
+}
+
+void BaseProject::headlessLoop() {
+std::cout << "Rendering " << headlessFrames << " offscreen frames\n" << std::flush;
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	for (int i = 0; (i < headlessFrames) && !inputReplayDone; i++) {
+		auto frameStart = std::chrono::high_resolution_clock::now();
 		drawFrame();
+		if (inputMode == ICM_REPLAY) {
+			auto frameEnd = std::chrono::high_resolution_clock::now();
+			replayFrameTimes.push_back(std::chrono::duration<float, std::chrono::milliseconds::period>
+					(frameEnd - frameStart).count());
+		}
 	}
 	
 	vkDeviceWaitIdle(device);
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	float totalMs = std::chrono::duration<float, std::chrono::milliseconds::period>
+				(endTime - startTime).count();
+	std::cout << "Headless run: " << headlessFrames << " frames in " << totalMs
+			  << " ms (" << totalMs / headlessFrames << " ms/frame)\n";
+	std::cout << frameTimer.getReport();
+	memoryAllocator.printReport();
+	descriptorAllocator.printStats("Descriptor sets");
+	hostAllocator.printStats();
 }
 
 void BaseProject::createCommandBuffer(NamedCommandBuffer *ncb, int imageIndex) {
 //std::cout << "Buffer: '" << ncb->name << "', id: " << imageIndex << "\n";
 
-	VkCommandBufferAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	allocInfo.commandPool = commandPool;
-	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	allocInfo.commandBufferCount = 1;
-	
-	VkCommandBuffer *cb = (VkCommandBuffer *)malloc(sizeof(VkCommandBuffer));
 //std::cout << "Allocating \n";		
-	VkResult result = vkAllocateCommandBuffers(device, &allocInfo, cb);
-//std::cout << "Checking \n";		
-	if (result != VK_SUCCESS) {
-		PrintVkError(result);
-		throw std::runtime_error("failed to allocate command buffer!");
-	}
+	VkCommandBuffer cb = acquireCommandBuffer(imageIndex);
 	ncb->cb[imageIndex] = cb;
 	ncb->inQueue[imageIndex] = true;
+	ncb->inQueueCount++;
 
 //std::cout << "Beginning\n";
 	VkCommandBufferBeginInfo beginInfo{};
@@ -1880,97 +2792,184 @@ void BaseProject::createCommandBuffer(NamedCommandBuffer *ncb, int imageIndex) {
 	beginInfo.flags = 0; // Optional
 	beginInfo.pInheritanceInfo = nullptr; // Optional
 
-	if (vkBeginCommandBuffer(*cb, &beginInfo) !=
+	if (vkBeginCommandBuffer(cb, &beginInfo) !=
 				VK_SUCCESS) {
 		throw std::runtime_error("failed to begin recording command buffer!");
 	}
 	
 //std::cout << "Filling\n";
-	ncb->filler(*cb, imageIndex, ncb->params);
+	ncb->filler(cb, imageIndex, ncb->params);
 	
 //std::cout << "Finishing\n";
-	if (vkEndCommandBuffer(*cb) != VK_SUCCESS) {
+	if (vkEndCommandBuffer(cb) != VK_SUCCESS) {
 		throw std::runtime_error("failed to record command buffer!");
 	}
 	
-//std::cout << "Closing: " << *cb << "\n";		
+//std::cout << "Closing: " << cb << "\n";		
 
 	// check if all buffers are now updated
-	int updCnt = 0;
-	for(int i = 0; i < ncb->inQueue.size(); i++) {
-		updCnt += (ncb->inQueue[i] ? 1 : 0);
-	}
-	if(updCnt == ncb->inQueue.size()) {
+	if(ncb->inQueueCount == ncb->inQueue.size()) {
 		ncb->state = NCBS_IN_USE;
 	} else {
 		ncb->state = NCBS_IN_CREATION;
 	}
 }
 
+// Appends to buffers the command buffers to submit for image imageIndex.
+// In the steady state (no buffer submitted or removed) it allocates nothing.
 void BaseProject::updateCommandBuffers(std::vector<VkCommandBuffer> &buffers, int imageIndex) {
-	// Creation of newly submitted command buffers
-	std::map<int, VkCommandBuffer>sortedBuffer = {};
+	// old versions release their buffers first, so the current ones can reuse them
+	for(int j = 0; j < retiringCommandBuffers.size(); ) {
+		NamedCommandBuffer *ocb = retiringCommandBuffers[j];
+//std::cout << "Found old version for c.b. '" << ocb->name << "'\n";
+		// the image is no longer in flight: its buffer can be released
+		clearNamedCommandBufferForImage(ocb, imageIndex);
+
+		// check if entry can be deleted
+		if(ocb->inQueueCount == 0) {
+			ocb->state = NCBS_DETACHED;
+			clearNamedCommandBuffer(ocb);
+			retiringCommandBuffers[j] = retiringCommandBuffers.back();
+			retiringCommandBuffers.pop_back();
+		} else {
+			ocb->state = NCBS_DELETING;
+			j++;
+		}
+	}
 	
-	for(auto &v : namedCommandBuffers) {
-//std::cout << "Considering buffer: " << v.first << "\n";
-		NamedCommandBuffer *ncb = v.second.current;
+	if(submissionListDirty) {
+		submissionList.clear();
+		for(auto &v : namedCommandBuffers) {
+			submissionList.push_back(v.second);
+		}
+		std::stable_sort(submissionList.begin(), submissionList.end(),
+			[](NamedCommandBuffer *a, NamedCommandBuffer *b) {
+				return a->order < b->order;
+			});
+		submissionListDirty = false;
+	}
+	
+	// Creation of newly submitted command buffers
+	for(NamedCommandBuffer *ncb : submissionList) {
+//std::cout << "Considering buffer: " << ncb->name << "\n";
 		if(ncb->state == NCBS_IN_USE) {
-			sortedBuffer[ncb->order] = *ncb->cb[imageIndex];
-//			buffers.push_back(*ncb->cb[imageIndex]);
+			buffers.push_back(ncb->cb[imageIndex]);
 		} else if((ncb->state == NCBS_SUBMITTED) || (ncb->state == NCBS_IN_CREATION)) {
 			if(!ncb->inQueue[imageIndex]) {
 				// this command buffer needs to be created
 				createCommandBuffer(ncb, imageIndex);
 			}
-			sortedBuffer[ncb->order] = *ncb->cb[imageIndex];
-//			buffers.push_back(*ncb->cb[imageIndex]);
+			buffers.push_back(ncb->cb[imageIndex]);
 		} else {
 			std::cout << "Error! state " << ncb->state << " not permitted here!\n";
 		}
-		
-		std::vector<int> toDelete = {};
-		for(int j = 0; j < v.second.old.size(); j++) {
-			NamedCommandBuffer *ocb = v.second.old[j];
-//std::cout << "Found old version for c.b. '" << ocb->name << "'\n";
-			if((ocb->state == NCBS_TO_DELETE) || (ocb->state == NCBS_DELETING)) {
-				if(ocb->inQueue[imageIndex]) {
-					// this command buffer needs to be deleted
-					clearNamedCommandBufferForImage(ocb, imageIndex);
-				}
-			}
+	}
+}
 
-			// check if entry can be deleted
-			int onCnt = 0;
-			for(int i = 0; i < ocb->inQueue.size(); i++) {
-				onCnt += (ocb->inQueue[i] ? 1 : 0);
-			}
-			if(onCnt == 0) {
-				ocb->state = NCBS_DETACHED;
-				toDelete.push_back(j);
-			} else {
-				ocb->state = NCBS_DELETING;
-			}
+// CPU cost of updateCommandBuffers() in the steady state, with 1, 10 and 100
+// named command buffers. The buffers are empty and never submitted.
+void BaseProject::benchmarkCommandBuffers() {
+	const int counts[] = {1, 10, 100};
+	const int frames = 100000;
+	int nImages = swapChainImages.size();
+	
+	// the application buffers are set aside during the measure
+	std::unordered_map<std::string, NamedCommandBuffer *> appBuffers;
+	appBuffers.swap(namedCommandBuffers);
+	submissionListDirty = true;
+	
+	std::vector<VkCommandBuffer> buffers;
+	for(int n : counts) {
+		for(int i = 0; i < n; i++) {
+			submitCommandBuffer("bench" + std::to_string(i), i,
+				[](VkCommandBuffer, int, void *) {}, nullptr);
+		}
+		// the first frames record the buffers
+		for(int img = 0; img < nImages; img++) {
+			buffers.clear();
+			updateCommandBuffers(buffers, img);
+		}
+		
+		auto startTime = std::chrono::high_resolution_clock::now();
+		for(int f = 0; f < frames; f++) {
+			buffers.clear();
+			updateCommandBuffers(buffers, f % nImages);
+		}
+		auto endTime = std::chrono::high_resolution_clock::now();
+		float totalNs = std::chrono::duration<float, std::chrono::nanoseconds::period>
+					(endTime - startTime).count();
+		std::cout << "updateCommandBuffers() with " << n << " named buffers: "
+				  << totalNs / frames << " ns/frame\n";
+		
+		for(int i = 0; i < n; i++) {
+			removeBuffer("bench" + std::to_string(i));
 		}
-//std::cout << toDelete.size() << " old c.b. of '" << v.first << "' can be erased\n";
-		for(int j = 0; j < toDelete.size(); j++) {
-			clearNamedCommandBuffer(v.second.old[toDelete[j]]);
-			v.second.old.erase(v.second.old.begin() + toDelete[j]);
+		for(int img = 0; img < nImages; img++) {
+			buffers.clear();
+			updateCommandBuffers(buffers, img);
 		}
 	}
 	
-	for(auto &m : sortedBuffer) {
-		buffers.push_back(m.second);
+	namedCommandBuffers.swap(appBuffers);
+	submissionListDirty = true;
+}
+
+void BaseProject::waitForFrame(uint64_t frameValue) {
+	VkSemaphoreWaitInfo waitInfo{};
+	waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &frameTimeline;
+	waitInfo.pValues = &frameValue;
+	
+	VkResult result = vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to wait for a frame!");
+	}
+}
+
+// true if the GPU has completed all the frames before frameValue
+bool BaseProject::isPreviousFrameComplete(uint64_t frameValue) {
+	if (frameValue <= 1) {
+		return false;
+	}
+	if (useTimeline) {
+		uint64_t completed = 0;
+		vkGetSemaphoreCounterValue(device, frameTimeline, &completed);
+		return completed >= frameValue - 1;
 	}
+	int prevFrame = (currentFrame + framesInFlight - 1) % framesInFlight;
+	return vkGetFenceStatus(device, inFlightFences[prevFrame]) == VK_SUCCESS;
 }
 
 void BaseProject::drawFrame() {
-	vkWaitForFences(device, 1, &inFlightFences[currentFrame],
-					VK_TRUE, UINT64_MAX);
+	frameTimer.beginFrame();
+	// value signaled by this frame
+	uint64_t frameValue = frameCounter + 1;
+	if (useTimeline) {
+		// the last frame that used the same semaphores
+		if (frameValue > framesInFlight) {
+			waitForFrame(frameValue - framesInFlight);
+		}
+	} else {
+		vkWaitForFences(device, 1, &inFlightFences[currentFrame],
+						VK_TRUE, UINT64_MAX);
+	}
+	frameTimer.stop(FTP_FENCE);
 	
 	uint32_t imageIndex;
 	
-	VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX,
+	VkResult result;
+	if (headless) {
+		// offscreen images are simply used in round robin
+		imageIndex = headlessImageIndex;
+		headlessImageIndex = (headlessImageIndex + 1) % swapChainImages.size();
+		result = VK_SUCCESS;
+	} else {
+		result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX,
 			imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+	}
+	frameTimer.stop(FTP_ACQUIRE);
 
 	if (result == VK_ERROR_OUT_OF_DATE_KHR) {
 		recreateSwapChain();
@@ -1979,16 +2978,40 @@ void BaseProject::drawFrame() {
 		throw std::runtime_error("failed to acquire swap chain image!");
 	}
 
-	if (imagesInFlight[imageIndex] != VK_NULL_HANDLE) {
-		vkWaitForFences(device, 1, &imagesInFlight[imageIndex],
-						VK_TRUE, UINT64_MAX);
+	if (useTimeline) {
+		if (imageFrameValue[imageIndex] > 0) {
+			waitForFrame(imageFrameValue[imageIndex]);
+		}
+		imageFrameValue[imageIndex] = frameValue;
+	} else {
+		if (imagesInFlight[imageIndex] != VK_NULL_HANDLE) {
+			vkWaitForFences(device, 1, &imagesInFlight[imageIndex],
+							VK_TRUE, UINT64_MAX);
+		}
+		imagesInFlight[imageIndex] = inFlightFences[currentFrame];
 	}
-	imagesInFlight[imageIndex] = inFlightFences[currentFrame];
+	frameTimer.stop(FTP_FENCE);
+	
+	// if the GPU has already run out of work, it stays idle until the submit
+	bool gpuDrained = isPreviousFrameComplete(frameValue);
+	auto gpuDrainedAt = std::chrono::high_resolution_clock::now();
 	
+	// the previous use of this image is complete: its timestamps are ready
+	gpuProfiler.collect(imageIndex);
+	
+	inputBeginFrame();
 	updateUniformBuffer(imageIndex);
+	inputEndFrame();
+	frameTimer.stop(FTP_UPDATE_UNIFORM);
 	
-	std::vector<VkCommandBuffer> buffers = {};
+	// reused every frame, to avoid allocating it
+	std::vector<VkCommandBuffer> &buffers = frameCommandBuffers;
+	buffers.clear();
+	if(gpuProfiler.active) {
+		buffers.push_back(gpuProfiler.resetCommandBuffers[imageIndex]);
+	}
 	updateCommandBuffers(buffers, imageIndex);
+	frameTimer.stop(FTP_UPDATE_CB);
 	
 	VkSubmitInfo submitInfo{};
 	
@@ -1996,21 +3019,65 @@ void BaseProject::drawFrame() {
 	VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
 	VkPipelineStageFlags waitStages[] =
 		{VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-	submitInfo.waitSemaphoreCount = 1;
+	submitInfo.waitSemaphoreCount = headless ? 0 : 1;
 	submitInfo.pWaitSemaphores = waitSemaphores;
 	submitInfo.pWaitDstStageMask = waitStages;
 	submitInfo.commandBufferCount = buffers.size();
 	submitInfo.pCommandBuffers = buffers.data();
-	VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
-	submitInfo.signalSemaphoreCount = 1;
+	VkSemaphore signalSemaphores[2];
+	uint64_t signalValues[2] = {0, 0};	// ignored for binary semaphores
+	uint32_t signalCount = 0;
+	if (!headless) {
+		signalSemaphores[signalCount++] = renderFinishedSemaphores[currentFrame];
+	}
+	if (useTimeline) {
+		signalValues[signalCount] = frameValue;
+		signalSemaphores[signalCount++] = frameTimeline;
+	}
+	submitInfo.signalSemaphoreCount = signalCount;
 	submitInfo.pSignalSemaphores = signalSemaphores;
 	
-	vkResetFences(device, 1, &inFlightFences[currentFrame]);
+	uint64_t waitValues[] = {0};
+	VkTimelineSemaphoreSubmitInfo timelineInfo{};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.waitSemaphoreValueCount = submitInfo.waitSemaphoreCount;
+	timelineInfo.pWaitSemaphoreValues = waitValues;
+	timelineInfo.signalSemaphoreValueCount = signalCount;
+	timelineInfo.pSignalSemaphoreValues = signalValues;
+	submitInfo.pNext = useTimeline ? &timelineInfo : nullptr;
+	
+	if (!gpuDrained) {
+		gpuDrained = isPreviousFrameComplete(frameValue);
+		gpuDrainedAt = std::chrono::high_resolution_clock::now();
+	}
+	frameTimer.set(FTP_GPU_IDLE, gpuDrained ?
+			std::chrono::duration<float, std::chrono::milliseconds::period>
+				(std::chrono::high_resolution_clock::now() - gpuDrainedAt).count() : 0.0f);
+	
+	VkFence submitFence = VK_NULL_HANDLE;
+	if (!useTimeline) {
+		submitFence = inFlightFences[currentFrame];
+		vkResetFences(device, 1, &submitFence);
+	}
 
 	if (vkQueueSubmit(graphicsQueue, 1, &submitInfo,
-			inFlightFences[currentFrame]) != VK_SUCCESS) {
+			submitFence) != VK_SUCCESS) {
 		throw std::runtime_error("failed to submit draw command buffer!");
 	}
+	frameCounter = frameValue;
+	gpuProfiler.markSubmitted(imageIndex);
+	frameTimer.stop(FTP_SUBMIT);
+	
+	if (headless) {
+		// nothing to present
+		if (framebufferResized) {
+			framebufferResized = false;
+			recreateSwapChain();
+		}
+		currentFrame = (currentFrame + 1) % framesInFlight;
+		frameTimer.endFrame();
+		return;
+	}
 	
 	VkPresentInfoKHR presentInfo{};
 	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -2024,6 +3091,7 @@ void BaseProject::drawFrame() {
 	presentInfo.pResults = nullptr; // Optional
 	
 	result = vkQueuePresentKHR(presentQueue, &presentInfo);
+	frameTimer.stop(FTP_PRESENT);
 
 	if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR ||
 		framebufferResized) {
@@ -2033,29 +3101,47 @@ void BaseProject::drawFrame() {
 		throw std::runtime_error("failed to present swap chain image!");
 	}
 	
-	currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+	currentFrame = (currentFrame + 1) % framesInFlight;
+	frameTimer.endFrame();
 }
 
 void BaseProject::recreateSwapChain() {
-	int width = 0, height = 0;
-	glfwGetFramebufferSize(window, &width, &height);
-	
-	while (width == 0 || height == 0) {
+	if (!headless) {
+		int width = 0, height = 0;
 		glfwGetFramebufferSize(window, &width, &height);
-		glfwWaitEvents();
+		
+		while (width == 0 || height == 0) {
+			glfwGetFramebufferSize(window, &width, &height);
+			glfwWaitEvents();
+		}
 	}
 
 	vkDeviceWaitIdle(device);
+	HostAllocationCounters hostStart = hostAllocator.getCounters();
 	
 	cleanupSwapChain();
+	gpuProfiler.cleanup();
 
-	createSwapChain();
+	if (headless) {
+		createHeadlessImages();
+	} else {
+		createSwapChain();
+	}
 	createImageViews();
+	// the number of images may have changed
+	imagesInFlight.assign(swapChainImages.size(), VK_NULL_HANDLE);
+	imageFrameValue.assign(swapChainImages.size(), 0);
+	uniformRing.setImageCount(swapChainImages.size());
 
-	createDescriptorPool();			
 	pipelinesAndDescriptorSetsInit();
 
 	resetCommandBuffers();
+	gpuProfiler.create();
+	memoryAllocator.trackSwapChainMemory();
+	
+	HostAllocationCounters hostDelta = hostAllocator.addSection("swap chain recreation", hostStart);
+	std::cout << "Swap chain recreation: " << hostDelta.totalAllocations()
+			  << " host allocations, " << hostDelta.totalBytes() << " bytes\n";
 }
 
 void BaseProject::cleanupSwapChain() {
@@ -2064,43 +3150,82 @@ void BaseProject::cleanupSwapChain() {
 	pipelinesAndDescriptorSetsCleanup();
 
 	for (size_t i = 0; i < swapChainImageViews.size(); i++){
-		vkDestroyImageView(device, swapChainImageViews[i], nullptr);
+		vkDestroyImageView(device, swapChainImageViews[i], allocationCallbacks);
 	}
 	
-	vkDestroySwapchainKHR(device, swapChain, nullptr);
+	if (headless) {
+		for (size_t i = 0; i < swapChainImages.size(); i++){
+			vkDestroyImage(device, swapChainImages[i], allocationCallbacks);
+			memoryAllocator.free(headlessImagesMemory[i]);
+		}
+	} else {
+		vkDestroySwapchainKHR(device, swapChain, allocationCallbacks);
+	}
 
-	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+	// all the descriptor sets have been cleaned up: their pools are kept
+	descriptorAllocator.reset();
 }
 	
 void BaseProject::cleanup() {
 	cleanupSwapChain();
 		
 	localCleanup();
+	assetRegistry.cleanup();
 	
-	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-		vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
-		vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
-		vkDestroyFence(device, inFlightFences[i], nullptr);
+	for (size_t i = 0; i < framesInFlight; i++) {
+		vkDestroySemaphore(device, renderFinishedSemaphores[i], allocationCallbacks);
+		vkDestroySemaphore(device, imageAvailableSemaphores[i], allocationCallbacks);
+		if (!useTimeline) {
+			vkDestroyFence(device, inFlightFences[i], allocationCallbacks);
+		}
+	}
+	if (useTimeline) {
+		vkDestroySemaphore(device, frameTimeline, allocationCallbacks);
 	}
 	
-	vkDestroyCommandPool(device, commandPool, nullptr);
+	gpuProfiler.cleanup();
+	stagingUploader.cleanup();
+	uniformRing.cleanup();
+	descriptorAllocator.cleanup();
+	destroyImageCommandPools();
+	vkDestroyCommandPool(device, commandPool, allocationCallbacks);
 	
-	vkDestroyDevice(device, nullptr);
+	memoryAllocator.cleanup();
+	vkDestroyDevice(device, allocationCallbacks);
 	
-	DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
+	DestroyDebugUtilsMessengerEXT(instance, debugMessenger, allocationCallbacks);
 	
-	vkDestroySurfaceKHR(instance, surface, nullptr);
-	vkDestroyInstance(instance, nullptr);
+	if (!headless) {
+		vkDestroySurfaceKHR(instance, surface, allocationCallbacks);
+	}
+	vkDestroyInstance(instance, allocationCallbacks);
+	hostAllocator.cleanup();
 
-	glfwDestroyWindow(window);
+	if (!headless) {
+		glfwDestroyWindow(window);
 
-	glfwTerminate();
+		glfwTerminate();
+	}
 }
 
 void BaseProject::RebuildPipeline() {
 	framebufferResized = true;
 }
 
+int BaseProject::getKey(int key) {
+	if (inputMode == ICM_REPLAY) {
+		return curInputFrame.keys[key];
+	}
+
+	// without a window, no key is ever pressed
+	int state = headless ? GLFW_RELEASE : glfwGetKey(window, key);
+	
+	if (inputMode == ICM_RECORD) {
+		curInputFrame.keys[key] = (uint8_t)state;
+	}
+	return state;
+}
+
 void BaseProject::handleGamePad(int id,  glm::vec3 &m, glm::vec3 &r, bool &fire) {
 	const float deadZone = 0.1f;
 	
@@ -2137,6 +3262,31 @@ void BaseProject::getSixAxis(float &deltaT,
 				glm::vec3 &m,
 				glm::vec3 &r,
 				bool &fire) {
+	if (inputMode == ICM_REPLAY) {
+		// fixed time step, unless the recorded one was requested
+		deltaT = (inputReplayDeltaT > 0.0f) ? inputReplayDeltaT : curInputFrame.deltaT;
+		m = glm::vec3(curInputFrame.m[0], curInputFrame.m[1], curInputFrame.m[2]);
+		r = glm::vec3(curInputFrame.r[0], curInputFrame.r[1], curInputFrame.r[2]);
+		fire = curInputFrame.fire != 0;
+		return;
+	}
+	
+	pollSixAxis(deltaT, m, r, fire);
+	
+	if (inputMode == ICM_RECORD) {
+		curInputFrame.deltaT = deltaT;
+		for (int i = 0; i < 3; i++) {
+			curInputFrame.m[i] = m[i];
+			curInputFrame.r[i] = r[i];
+		}
+		curInputFrame.fire = fire ? 1 : 0;
+	}
+}
+
+void BaseProject::pollSixAxis(float &deltaT,
+				glm::vec3 &m,
+				glm::vec3 &r,
+				bool &fire) {
 					
 	static auto startTime = std::chrono::high_resolution_clock::now();
 	static float lastTime = 0.0f;
@@ -2147,6 +3297,11 @@ void BaseProject::getSixAxis(float &deltaT,
 	deltaT = time - lastTime;
 	lastTime = time;
 
+	if (headless) {
+		fire = false;
+		return;
+	}
+
 	static double old_xpos = 0, old_ypos = 0;
 	double xpos, ypos;
 	glfwGetCursorPos(window, &xpos, &ypos);
@@ -2206,6 +3361,82 @@ void BaseProject::getSixAxis(float &deltaT,
 	handleGamePad(GLFW_JOYSTICK_4,m,r,fire);
 }
 
+void BaseProject::openInputCapture() {
+	const char header[4] = {'I', 'N', 'P', '1'};
+
+	if (inputMode == ICM_RECORD) {
+		inputRecordFile.open(inputFileName, std::ios::binary);
+		if (!inputRecordFile.is_open()) {
+			std::cout << "Failed to open: " << inputFileName << "\n";
+			throw std::runtime_error("failed to open input recording file!");
+		}
+		inputRecordFile.write(header, sizeof(header));
+std::cout << "Recording input to: " << inputFileName << "\n";
+	} else if (inputMode == ICM_REPLAY) {
+		std::vector<char> data = readFile(inputFileName);
+		if ((data.size() < sizeof(header)) || (memcmp(data.data(), header, sizeof(header)) != 0)) {
+			throw std::runtime_error("invalid input recording file!");
+		}
+		size_t n = (data.size() - sizeof(header)) / sizeof(InputFrame);
+		inputReplayFrames.resize(n);
+		memcpy(inputReplayFrames.data(), data.data() + sizeof(header), n * sizeof(InputFrame));
+		inputReplayPos = 0;
+		inputReplayDone = (n == 0);
+		replayFrameTimes.reserve(n);
+std::cout << "Replaying " << n << " input frames from: " << inputFileName << "\n";
+	}
+}
+
+void BaseProject::closeInputCapture() {
+	if (inputMode == ICM_RECORD) {
+		inputRecordFile.close();
+	} else if (inputMode == ICM_REPLAY) {
+		printReplayStats();
+	}
+}
+
+void BaseProject::inputBeginFrame() {
+	if (inputMode == ICM_REPLAY) {
+		if (inputReplayPos < inputReplayFrames.size()) {
+			curInputFrame = inputReplayFrames[inputReplayPos];
+		} else {
+			memset(&curInputFrame, 0, sizeof(InputFrame));
+		}
+	} else if (inputMode == ICM_RECORD) {
+		memset(&curInputFrame, 0, sizeof(InputFrame));
+	}
+}
+
+void BaseProject::inputEndFrame() {
+	if (inputMode == ICM_RECORD) {
+		inputRecordFile.write((const char *)&curInputFrame, sizeof(InputFrame));
+	} else if (inputMode == ICM_REPLAY) {
+		inputReplayPos++;
+		if (inputReplayPos >= inputReplayFrames.size()) {
+			inputReplayDone = true;
+		}
+	}
+}
+
+void BaseProject::printReplayStats() {
+	if (replayFrameTimes.empty()) {
+		return;
+	}
+	std::vector<float> sorted = replayFrameTimes;
+	std::sort(sorted.begin(), sorted.end());
+	
+	auto percentile = [&sorted](float p) {
+		size_t i = (size_t)(p * (sorted.size() - 1) + 0.5f);
+		return sorted[i];
+	};
+	
+	std::cout << "Replay: " << sorted.size() << " frames, frame time (ms)"
+			  << " p50: " << percentile(0.50f)
+			  << " p95: " << percentile(0.95f)
+			  << " p99: " << percentile(0.99f)
+			  << " max: " << sorted.back() << "\n";
+}
+
 void BaseProject::printFloat(const char *Name, float v) {
 	std::cout << "float " << Name << " = " << v << ";\n";
 }
@@ -2320,7 +3551,7 @@ void BaseProject::vulkanDevice_flushCommandBuffer(VkCommandBuffer commandBuffer,
 	// Create fence to ensure that the command buffer has finished executing
 	VkFenceCreateInfo fenceInfo = vks_initializers_fenceCreateInfo(VK_FLAGS_NONE);
 	VkFence fence;
-	result = vkCreateFence(device, &fenceInfo, nullptr, &fence);
+	result = vkCreateFence(device, &fenceInfo, allocationCallbacks, &fence);
 	if(result != VK_SUCCESS) {
 		PrintVkError(result);
 		throw std::runtime_error("failed to create screenshot!");
@@ -2337,7 +3568,7 @@ void BaseProject::vulkanDevice_flushCommandBuffer(VkCommandBuffer commandBuffer,
 		PrintVkError(result);
 		throw std::runtime_error("failed to create screenshot!");
 	}
-	vkDestroyFence(device, fence, nullptr);
+	vkDestroyFence(device, fence, allocationCallbacks);
 	if (freeCmd)
 	{
 		clearCommandBuffers();
@@ -2441,7 +3672,7 @@ void BaseProject::saveScreenshot(const char *filename, int currentBuffer) {
 	imageCreateCI.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 	// Create the image
 	VkImage dstImage;
-	result = vkCreateImage(device, &imageCreateCI, nullptr, &dstImage);
+	result = vkCreateImage(device, &imageCreateCI, allocationCallbacks, &dstImage);
 	if(result != VK_SUCCESS) {
 		PrintVkError(result);
 		throw std::runtime_error("failed to create screenshot!");
@@ -2454,7 +3685,7 @@ void BaseProject::saveScreenshot(const char *filename, int currentBuffer) {
 	memAllocInfo.allocationSize = memRequirements.size;
 	// Memory must be host visible to copy from
 	memAllocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-	result = vkAllocateMemory(device, &memAllocInfo, nullptr, &dstImageMemory);
+	result = vkAllocateMemory(device, &memAllocInfo, allocationCallbacks, &dstImageMemory);
 	if(result != VK_SUCCESS) {
 		PrintVkError(result);
 		throw std::runtime_error("failed to create screenshot!!");
@@ -2615,8 +3846,8 @@ void BaseProject::saveScreenshot(const char *filename, int currentBuffer) {
 
 	// Clean up resources
 	vkUnmapMemory(device, dstImageMemory);
-	vkFreeMemory(device, dstImageMemory, nullptr);
-	vkDestroyImage(device, dstImage, nullptr);
+	vkFreeMemory(device, dstImageMemory, allocationCallbacks);
+	vkDestroyImage(device, dstImage, allocationCallbacks);
 
 	screenshotSaved = true;
 }	
@@ -2792,6 +4023,9 @@ void AssetFile::init(std::string file, ModelType MT) {
 	if(type == GLTF) {
 		initGLTF(file);
 	}
+	if(type == MGCG) {
+		initGLTF(readFile(file), file, true);
+	}
 }
 
 
@@ -2811,20 +4045,24 @@ void AssetFile::initOBJ(std::string file) {
 		matpath = nullptr;
 //	}
 	
-	std::cout << "Loading Asset File: " << file << "[OBJ] - mat. path: " << (matpath == nullptr ? "<<NOPATH>>" : matpath) << "\n";	
+	// files are loaded by several threads: the log is written at once
+	std::ostringstream log;
+	log << "Loading Asset File: " << file << "[OBJ] - mat. path: " << (matpath == nullptr ? "<<NOPATH>>" : matpath) << "\n";	
 	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
 						  file.c_str(), matpath)) {
+		std::cout << log.str();
 		throw std::runtime_error(warn + err);
 	}
 /*	std::cout << "Asset has: " << materials.size() << " materials\n";*/
 	for (const auto& shape : shapes) {
-		std::cout << " Name:" << shape.name << "\n";
+		log << " Name:" << shape.name << "\n";
 		OBJmeshes[shape.name] = &shape;
 /*		for (const auto& id : shape.mesh.material_ids) {
 			std::cout << id << "\t";
 		}
 		std::cout << "\n";*/
 	}
+	std::cout << log.str();
 	
 	if(matpath != nullptr) {
 		free(matpath);
@@ -2832,25 +4070,41 @@ void AssetFile::initOBJ(std::string file) {
 }
 
 void AssetFile::initGLTF(std::string file) {
+	initGLTF(readFile(file), file, false);
+}
+
+void AssetFile::initGLTF(const std::vector<char> &data, std::string file, bool encoded) {
 	// GLTF assets stuff
 	tinygltf::TinyGLTF loader;
 	std::string warn, err;
+	bool loaded;
 
-	std::cout << "Loading Asset File: " << file << "[GLTF]\n";	
-	if (!loader.LoadASCIIFromFile(&model, &warn, &err, 
-					file.c_str())) {
+	// files are loaded by several threads: the log is written at once
+	std::ostringstream log;
+	log << "Loading Asset File: " << file << (encoded ? "[MGCG]\n" : "[GLTF]\n");	
+	if(encoded) {
+		std::vector<char> decoded = decodeMGCG(data);
+		loaded = loader.LoadASCIIFromString(&model, &warn, &err, 
+						decoded.data(), decoded.size(), "/");
+	} else {
+		// external buffers are relative to the directory of the file
+		std::string baseDir = std::filesystem::path(file).parent_path().string();
+		loaded = loader.LoadASCIIFromString(&model, &warn, &err, 
+						data.data(), data.size(), baseDir);
+	}
+	if (!loaded) {
+		std::cout << log.str();
 		throw std::runtime_error(warn + err);
 	}
 
-
 	for (const auto& mesh :  model.meshes) {
-		std::cout << " Name:" << mesh.name << " Primitives: " << mesh.primitives.size() << "\n";
+		log << " Name:" << mesh.name << " Primitives: " << mesh.primitives.size() << "\n";
 		int PrimCount = 0;
 		for (const auto& primitive :  mesh.primitives) {
 			if (primitive.indices < 0) {
 				continue;
 			} else {
-				std::cout << "Primitive: " << PrimCount << ", Material: " <<
+				log << "Primitive: " << PrimCount << ", Material: " <<
 					primitive.material << " -> " << model.materials[primitive.material].name <<"\n";
 			}
 			GLTFmeshes[mesh.name].push_back(&primitive);
@@ -2860,66 +4114,204 @@ void AssetFile::initGLTF(std::string file) {
 
 	int cnt = 0;
 	for (const auto& node :  model.nodes) {
-		std::cout << "Node: " << cnt ++ << " Mesh: " << node.mesh << " Name:" << node.name << "\n";
+		log << "Node: " << cnt ++ << " Mesh: " << node.mesh << " Name:" << node.name << "\n";
 		GLTFnodes[node.name] = &node;
 	}
+	std::cout << log.str();
 }
 
 void AssetFile::cleanup() {
 }
+
+AssetFile *AssetRegistry::acquire(std::string file, ModelType MT) {
+	std::error_code ec;
+	std::filesystem::path canonical = std::filesystem::weakly_canonical(file, ec);
+	if(ec) {
+		canonical = std::filesystem::absolute(file);
+	}
+	std::string pathKey = canonical.string() + "#" + std::to_string((int)MT);
+	
+	Entry *E = nullptr;
+	std::vector<char> data;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto found = paths.find(pathKey);
+		if(found != paths.end()) {
+			E = found->second;
+			E->refs++;
+			hits++;
+		}
+	}
+	
+	if(E == nullptr) {
+		// only files not seen yet are read and hashed
+		data = readFile(file);
+		uint64_t key = hashBytes(data.data(), data.size(), hashBytes(&MT, sizeof(MT)));
+		if(MT != MGCG) {
+			// external buffers, images and materials are relative to the file
+			std::string baseDir = canonical.parent_path().string();
+			key = hashBytes(baseDir.data(), baseDir.size(), key);
+		}
+		
+		std::lock_guard<std::mutex> guard(lock);
+		auto found = entries.find(key);
+		if(found != entries.end()) {
+			E = found->second;
+			hits++;
+		} else {
+			E = new Entry();
+			E->AF = new AssetFile();
+			E->AF->registry = this;
+			E->refs = 0;
+			entries[key] = E;
+			keys[E->AF] = key;
+			parses++;
+		}
+		if(paths.find(pathKey) == paths.end()) {
+			paths[pathKey] = E;
+			E->paths.push_back(pathKey);
+		}
+		E->refs++;
+	}
+	
+	// the first user parses the file, the others wait for it
+	std::call_once(E->parsed, [&]() {
+		E->AF->type = MT;
+		if(MT == OBJ) {
+			E->AF->initOBJ(file);
+		} else {
+			// found by path before the thread that read it got here
+			if(data.empty()) {
+				data = readFile(file);
+			}
+			E->AF->initGLTF(data, file, MT == MGCG);
+		}
+	});
+	return E->AF;
+}
+
+void AssetRegistry::retain(AssetFile *AF) {
+	std::lock_guard<std::mutex> guard(lock);
+	entries[keys[AF]]->refs++;
+}
+
+void AssetRegistry::release(AssetFile *AF) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto key = keys.find(AF);
+	if(key == keys.end()) {
+		return;
+	}
+	Entry *E = entries[key->second];
+	if(--E->refs > 0) {
+		return;
+	}
+	entries.erase(key->second);
+	keys.erase(key);
+	for(auto &p : E->paths) {
+		paths.erase(p);
+	}
+	E->AF->cleanup();
+	delete E->AF;
+	delete E;
+}
+
+void AssetRegistry::cleanup() {
+	std::lock_guard<std::mutex> guard(lock);
+	if(entries.size() > 0) {
+		std::cout << "Asset registry: " << entries.size() << " asset files still referenced\n";
+	}
+	for(auto &E : entries) {
+		E.second->AF->cleanup();
+		delete E.second->AF;
+		delete E.second;
+	}
+	entries.clear();
+	paths.clear();
+	keys.clear();
+}
 	
 
 
 
 
+// Corners with the same position, color, UV and normal share a vertex:
+// each corner is written at the end of the vertex array, and it is
+// dropped if an equal vertex is already in the set
 void Model::makeOBJMesh(const tinyobj::shape_t *M, const tinyobj::attrib_t *A) {
 	int mainStride = VD->Bindings[0].stride;
-	int newId = 0;
+	size_t base = vertices.size() / mainStride;
+	
+	const std::vector<unsigned char> &V = vertices;
+	auto vertexHash = [&V, mainStride](uint32_t id) {
+		return (size_t)hashBytes(&V[(size_t)id * mainStride], mainStride);
+	};
+	auto vertexEqual = [&V, mainStride](uint32_t a, uint32_t b) {
+		return memcmp(&V[(size_t)a * mainStride], &V[(size_t)b * mainStride], mainStride) == 0;
+	};
+	std::unordered_set<uint32_t, decltype(vertexHash), decltype(vertexEqual)>
+			unique(M->mesh.indices.size(), vertexHash, vertexEqual);
+	
+	// at most one vertex per corner
+	vertices.reserve(vertices.size() + M->mesh.indices.size() * mainStride);
+	indices.reserve(indices.size() + M->mesh.indices.size());
 	for (const auto& index : M->mesh.indices) {
-		std::vector<unsigned char> vertex(mainStride, 0);
+		uint32_t newId = vertices.size() / mainStride;
+		vertices.resize(vertices.size() + mainStride, 0);
+		unsigned char *vertex = &vertices[(size_t)newId * mainStride];
+		
 		glm::vec3 pos = {
 			A->vertices[3 * index.vertex_index + 0],
 			A->vertices[3 * index.vertex_index + 1],
 			A->vertices[3 * index.vertex_index + 2]
 		};
 		if(VD->Position.hasIt) {
-			glm::vec3 *o = (glm::vec3 *)((char*)(&vertex[0]) + VD->Position.offset);
+			glm::vec3 *o = (glm::vec3 *)((char*)vertex + VD->Position.offset);
 			*o = pos;
 		}
 		
-		glm::vec3 color = {
-			A->colors[3 * index.vertex_index + 0],
-			A->colors[3 * index.vertex_index + 1],
-			A->colors[3 * index.vertex_index + 2]
-		};
 		if(VD->Color.hasIt) {
-			glm::vec3 *o = (glm::vec3 *)((char*)(&vertex[0]) + VD->Color.offset);
+			glm::vec3 color = {
+				A->colors[3 * index.vertex_index + 0],
+				A->colors[3 * index.vertex_index + 1],
+				A->colors[3 * index.vertex_index + 2]
+			};
+			glm::vec3 *o = (glm::vec3 *)((char*)vertex + VD->Color.offset);
 			*o = color;
 		}
 		
-		glm::vec2 texCoord = {
-			A->texcoords[2 * index.texcoord_index + 0],
-			1 - A->texcoords[2 * index.texcoord_index + 1] 
-		};
-		if(VD->UV.hasIt) {
-			glm::vec2 *o = (glm::vec2 *)((char*)(&vertex[0]) + VD->UV.offset);
+		if(VD->UV.hasIt && (index.texcoord_index >= 0)) {
+			glm::vec2 texCoord = {
+				A->texcoords[2 * index.texcoord_index + 0],
+				1 - A->texcoords[2 * index.texcoord_index + 1] 
+			};
+			glm::vec2 *o = (glm::vec2 *)((char*)vertex + VD->UV.offset);
 			*o = texCoord;
 		}
 
-		glm::vec3 norm = {
-			A->normals[3 * index.normal_index + 0],
-			A->normals[3 * index.normal_index + 1],
-			A->normals[3 * index.normal_index + 2]
-		};
-		if(VD->Normal.hasIt) {
-			glm::vec3 *o = (glm::vec3 *)((char*)(&vertex[0]) + VD->Normal.offset);
+		if(VD->Normal.hasIt && (index.normal_index >= 0)) {
+			glm::vec3 norm = {
+				A->normals[3 * index.normal_index + 0],
+				A->normals[3 * index.normal_index + 1],
+				A->normals[3 * index.normal_index + 2]
+			};
+			glm::vec3 *o = (glm::vec3 *)((char*)vertex + VD->Normal.offset);
 			*o = norm;
 		}
 		
-		vertices.insert(vertices.end(), vertex.begin(), vertex.end());
-//			indices.push_back((vertices.size()/mainStride)-1);
-		indices.push_back(newId++);
+		auto found = unique.find(newId);
+		if(found != unique.end()) {
+			vertices.resize(vertices.size() - mainStride);
+			indices.push_back(*found);
+		} else {
+			unique.insert(newId);
+			indices.push_back(newId);
+		}
 	}
+	
+	std::ostringstream log;
+	log << "[OBJ] " << M->name << ": " << M->mesh.indices.size() << " corners -> "
+		<< (vertices.size() / mainStride - base) << " vertices\n";
+	std::cout << log.str();
 }
 
 void Model::loadModelOBJ(std::string file) {
@@ -2928,7 +4320,8 @@ void Model::loadModelOBJ(std::string file) {
 	std::vector<tinyobj::material_t> materials;
 	std::string warn, err;
 	
-	std::cout << "Loading : " << file << "[OBJ]\n";	
+	// models are loaded by several threads: each line is written at once
+	std::cout << ("Loading : " + file + "[OBJ]\n");	
 	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
 						  file.c_str())) {
 		throw std::runtime_error(warn + err);
@@ -2941,236 +4334,221 @@ void Model::loadModelOBJ(std::string file) {
 	for (const auto& shape : shapes) {
 		makeOBJMesh(&shape, &attrib);
 	}
-	std::cout << "[OBJ] Vertices: "<< (vertices.size()/VD->Bindings[0].stride);
-	std::cout << " Indices: "<< indices.size() << "\n";
-	
-}
-
-void Model::makeGLTFMesh(tinygltf::Model *M, const tinygltf::Primitive *Prm) {
-	int mainStride = VD->Bindings[0].stride;
-
-	const float *bufferPos = nullptr;
-	const float *bufferNormals = nullptr;
-	const float *bufferTangents = nullptr;
-	const float *bufferTexCoords = nullptr;
-	const glm::u8 *bufferJointIndex = nullptr;
-	const float *bufferJointWeight = nullptr;
-	
-	bool meshHasPos = false;
-	bool meshHasNorm = false;
-	bool meshHasTan = false;
-	bool meshHasUV = false;
-	bool meshHasJointIndex = false;
-	bool meshHasJointWeight = false;
-	
-	int cntPos = 0;
-	int cntNorm = 0;
-	int cntTan = 0;
-	int cntUV = 0;
-	int cntJointIndex = 0;
-	int cntJointWeight = 0;
-	int cntTot = 0;
-
-	auto pIt = Prm->attributes.find("POSITION");
-	if(pIt != Prm->attributes.end()) {
-		const tinygltf::Accessor &posAccessor = M->accessors[pIt->second];
-		const tinygltf::BufferView &posView = M->bufferViews[posAccessor.bufferView];
-		bufferPos = reinterpret_cast<const float *>(&(M->buffers[posView.buffer].data[posAccessor.byteOffset + posView.byteOffset]));
-		meshHasPos = true;
-		cntPos = posAccessor.count;
-		if(cntPos > cntTot) cntTot = cntPos;
-	} else {
-		if(VD->Position.hasIt) {
-			std::cout << "Warning: vertex layout has position, but file hasn't\n";
-		}
-	}
-	
-	auto nIt = Prm->attributes.find("NORMAL");
-	if(nIt != Prm->attributes.end()) {
-		const tinygltf::Accessor &normAccessor = M->accessors[nIt->second];
-		const tinygltf::BufferView &normView = M->bufferViews[normAccessor.bufferView];
-		bufferNormals = reinterpret_cast<const float *>(&(M->buffers[normView.buffer].data[normAccessor.byteOffset + normView.byteOffset]));
-		meshHasNorm = true;
-		cntNorm = normAccessor.count;
-		if(cntNorm > cntTot) cntTot = cntNorm;
-	} else {
-		if(VD->Normal.hasIt) {
-			std::cout << "Warning: vertex layout has normal, but file hasn't\n";
+	// makeOBJMesh() reserves one vertex per corner
+	vertices.shrink_to_fit();
+	std::ostringstream log;
+	log << "[OBJ] Vertices: "<< (vertices.size()/VD->Bindings[0].stride);
+	log << " Indices: "<< indices.size() << "\n";
+	std::cout << log.str();
+	
+}
+
+// Conversion of the glTF vertex attributes to the 32 bit components of the
+// vertex layout: src and dst are walked with their own strides, and only
+// the first n components are written
+template <class S, bool isSigned>
+static void convertGLTFToFloat(const unsigned char *src, int srcStride, int n, float scale,
+							   unsigned char *dst, int dstStride, int count) {
+	for(int i = 0; i < count; i++) {
+		const S *s = reinterpret_cast<const S *>(src + (size_t)i * srcStride);
+		float *d = reinterpret_cast<float *>(dst + (size_t)i * dstStride);
+		for(int c = 0; c < n; c++) {
+			d[c] = isSigned ? std::max(s[c] * scale, -1.0f) : s[c] * scale;
 		}
 	}
+}
 
-	auto tIt = Prm->attributes.find("TANGENT");
-	if(tIt != Prm->attributes.end()) {
-		const tinygltf::Accessor &tanAccessor = M->accessors[tIt->second];
-		const tinygltf::BufferView &tanView = M->bufferViews[tanAccessor.bufferView];
-		bufferTangents = reinterpret_cast<const float *>(&(M->buffers[tanView.buffer].data[tanAccessor.byteOffset + tanView.byteOffset]));
-		meshHasTan = true;
-		cntTan = tanAccessor.count;
-		if(cntTan > cntTot) cntTot = cntTan;
-	} else {
-		if(VD->Tangent.hasIt) {
-			std::cout << "Warning: vertex layout has tangent, but file hasn't\n";
+template <class S>
+static void convertGLTFToUint(const unsigned char *src, int srcStride, int n,
+							  unsigned char *dst, int dstStride, int count) {
+	for(int i = 0; i < count; i++) {
+		const S *s = reinterpret_cast<const S *>(src + (size_t)i * srcStride);
+		uint32_t *d = reinterpret_cast<uint32_t *>(dst + (size_t)i * dstStride);
+		for(int c = 0; c < n; c++) {
+			d[c] = s[c];
 		}
 	}
+}
 
-	auto uIt = Prm->attributes.find("TEXCOORD_0");
-	if(uIt != Prm->attributes.end()) {
-		const tinygltf::Accessor &uvAccessor = M->accessors[uIt->second];
-		const tinygltf::BufferView &uvView = M->bufferViews[uvAccessor.bufferView];
-		bufferTexCoords = reinterpret_cast<const float *>(&(M->buffers[uvView.buffer].data[uvAccessor.byteOffset + uvView.byteOffset]));
-		meshHasUV = true;
-		cntUV = uvAccessor.count;
-		if(cntUV > cntTot) cntTot = cntUV;
-	} else {
-		if(VD->UV.hasIt) {
-			std::cout << "Warning: vertex layout has UV, but file hasn't\n";
+#if defined(__SSE2__) || defined(_M_X64)
+// Four unsigned 8 or 16 bit components (joints and weights) widened in a
+// single step: the integers are unpacked with zeros, and optionally
+// converted to float and scaled
+static void convertGLTFQuad(const unsigned char *src, int srcStride, bool shortComponents,
+							bool toFloat, float scale,
+							unsigned char *dst, int dstStride, int count) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 vScale = _mm_set1_ps(scale);
+	for(int i = 0; i < count; i++) {
+		const unsigned char *s = src + (size_t)i * srcStride;
+		__m128i v;
+		if(shortComponents) {
+			v = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(s)), zero);
+		} else {
+			int32_t packed;
+			memcpy(&packed, s, sizeof(packed));
+			v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+		}
+		unsigned char *d = dst + (size_t)i * dstStride;
+		if(toFloat) {
+			_mm_storeu_ps(reinterpret_cast<float *>(d), _mm_mul_ps(_mm_cvtepi32_ps(v), vScale));
+		} else {
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(d), v);
 		}
 	}
+}
+#endif
 
-	auto iIt = Prm->attributes.find("JOINTS_0");
-	if(iIt != Prm->attributes.end()) {
-		const tinygltf::Accessor &jointAccessor = M->accessors[iIt->second];
-		const tinygltf::BufferView &jointView = M->bufferViews[jointAccessor.bufferView];
-		bufferJointIndex = reinterpret_cast<const glm::u8 *>(&(M->buffers[jointView.buffer].data[jointAccessor.byteOffset + jointView.byteOffset]));
-		meshHasJointIndex = true;
-		cntJointIndex = jointAccessor.count;
-		if(cntJointIndex > cntTot) cntTot = cntJointIndex;
-	} else {
-		if(VD->JointIndex.hasIt) {
-			std::cout << "Warning: vertex layout has Joint, but file hasn't\n";
-		}
+// Copies an accessor into a component of the interleaved vertices
+static void copyGLTFAttribute(const tinygltf::Model *M, const tinygltf::Accessor &accessor,
+							  int dstComponents, bool dstUint, unsigned char *dst, int dstStride) {
+	if(accessor.bufferView < 0) {
+		std::cout << "Warning: accessors without buffer view are not supported\n";
+		return;
 	}
-	auto wIt = Prm->attributes.find("WEIGHTS_0");
-	if(wIt != Prm->attributes.end()) {
-		const tinygltf::Accessor &weightsAccessor = M->accessors[wIt->second];
-		const tinygltf::BufferView &weightsView = M->bufferViews[weightsAccessor.bufferView];
-		bufferJointWeight = reinterpret_cast<const float *>(&(M->buffers[weightsView.buffer].data[weightsAccessor.byteOffset + weightsView.byteOffset]));
-		meshHasJointWeight = true;
-		cntJointWeight = weightsAccessor.count;
-		if(cntJointWeight > cntTot) cntTot = cntJointWeight;
+	const tinygltf::BufferView &view = M->bufferViews[accessor.bufferView];
+	const unsigned char *src = &(M->buffers[view.buffer].data[view.byteOffset + accessor.byteOffset]);
+	int srcStride = accessor.ByteStride(view);
+	if(srcStride <= 0) {
+		throw std::runtime_error("invalid glTF accessor stride!");
+	}
+	int n = std::min(tinygltf::GetNumComponentsInType(accessor.type), dstComponents);
+	int count = accessor.count;
+	bool norm = accessor.normalized;
+	
+	if(dstUint) {
+		switch(accessor.componentType) {
+		  case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+#if defined(__SSE2__) || defined(_M_X64)
+			if(n == 4) {
+				convertGLTFQuad(src, srcStride, false, false, 1.0f, dst, dstStride, count);
+				return;
+			}
+#endif
+			convertGLTFToUint<uint8_t>(src, srcStride, n, dst, dstStride, count);
+			return;
+		  case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+#if defined(__SSE2__) || defined(_M_X64)
+			if(n == 4) {
+				convertGLTFQuad(src, srcStride, true, false, 1.0f, dst, dstStride, count);
+				return;
+			}
+#endif
+			convertGLTFToUint<uint16_t>(src, srcStride, n, dst, dstStride, count);
+			return;
+		  case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+			convertGLTFToUint<uint32_t>(src, srcStride, n, dst, dstStride, count);
+			return;
+		}
 	} else {
-		if(VD->JointWeight.hasIt) {
-			std::cout << "Warning: vertex layout has Weights, but file hasn't\n";
+		switch(accessor.componentType) {
+		  case TINYGLTF_COMPONENT_TYPE_FLOAT:
+			for(int i = 0; i < count; i++) {
+				memcpy(dst + (size_t)i * dstStride, src + (size_t)i * srcStride, n * sizeof(float));
+			}
+			return;
+		  case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+#if defined(__SSE2__) || defined(_M_X64)
+			if(n == 4) {
+				convertGLTFQuad(src, srcStride, false, true, norm ? 1.0f / 255.0f : 1.0f,
+								dst, dstStride, count);
+				return;
+			}
+#endif
+			convertGLTFToFloat<uint8_t, false>(src, srcStride, n, norm ? 1.0f / 255.0f : 1.0f,
+											   dst, dstStride, count);
+			return;
+		  case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+#if defined(__SSE2__) || defined(_M_X64)
+			if(n == 4) {
+				convertGLTFQuad(src, srcStride, true, true, norm ? 1.0f / 65535.0f : 1.0f,
+								dst, dstStride, count);
+				return;
+			}
+#endif
+			convertGLTFToFloat<uint16_t, false>(src, srcStride, n, norm ? 1.0f / 65535.0f : 1.0f,
+												dst, dstStride, count);
+			return;
+		  case TINYGLTF_COMPONENT_TYPE_BYTE:
+			if(norm) {
+				convertGLTFToFloat<int8_t, true>(src, srcStride, n, 1.0f / 127.0f, dst, dstStride, count);
+			} else {
+				convertGLTFToFloat<int8_t, false>(src, srcStride, n, 1.0f, dst, dstStride, count);
+			}
+			return;
+		  case TINYGLTF_COMPONENT_TYPE_SHORT:
+			if(norm) {
+				convertGLTFToFloat<int16_t, true>(src, srcStride, n, 1.0f / 32767.0f, dst, dstStride, count);
+			} else {
+				convertGLTFToFloat<int16_t, false>(src, srcStride, n, 1.0f, dst, dstStride, count);
+			}
+			return;
 		}
 	}
+	std::cout << ("Warning: vertex component type " + std::to_string(accessor.componentType) + " not supported\n");
+}
 
-//std::cout << "making vertex array. Stride:" << mainStride << "\n";
-//	std::unordered_map<int, bool> usedIndices;
-
-	for(int i = 0; i < cntTot; i++) {
-		std::vector<unsigned char> vertex(mainStride, 0);
-//std::cout << vertices.size() << "," << vertex.size() << "," << &vertex << " " << &vertex[0] << " ";
-//std::cout << i << "\n";
-		
-		if((i < cntPos) && meshHasPos && VD->Position.hasIt) {
-			glm::vec3 pos = {
-				bufferPos[3 * i + 0],
-				bufferPos[3 * i + 1],
-				bufferPos[3 * i + 2]
-			};
-//std::cout << "Pos: " <<	VD->Position.offset << "\n";
-			glm::vec3 *o = (glm::vec3 *)((char*)(&vertex[0]) + VD->Position.offset);
-//std::cout << "at: " << o << "\n";
-			*o = pos;
-//std::cout << "Copied: " << o->x << "\n";
-		}
-		if((i < cntNorm) && meshHasNorm && VD->Normal.hasIt) {
-			glm::vec3 normal = {
-				bufferNormals[3 * i + 0],
-				bufferNormals[3 * i + 1],
-				bufferNormals[3 * i + 2]
-			};
-//std::cout << "Nor: " <<	VD->Normal.offset << "\n";
-			glm::vec3 *o = (glm::vec3 *)((char*)(&vertex[0]) + VD->Normal.offset);
-			*o = normal;
-		}
-
-		if((i < cntTan) && meshHasTan && VD->Tangent.hasIt) {
-			glm::vec4 tangent = {
-				bufferTangents[4 * i + 0],
-				bufferTangents[4 * i + 1],
-				bufferTangents[4 * i + 2],
-				bufferTangents[4 * i + 3]
-			};
-//std::cout << "Tan: " <<	VD->Tangent.offset << "\n";
-			glm::vec4 *o = (glm::vec4 *)((char*)(&vertex[0]) + VD->Tangent.offset);
-			*o = tangent;
-		}
-		
-		if((i < cntUV) && meshHasUV && VD->UV.hasIt) {
-			glm::vec2 texCoord = {
-				bufferTexCoords[2 * i + 0],
-				bufferTexCoords[2 * i + 1] 
-			};
-//std::cout << "UV : " <<	VD->UV.offset << "\n";
-			glm::vec2 *o = (glm::vec2 *)((char*)(&vertex[0]) + VD->UV.offset);
-			*o = texCoord;
-		}
-
-
-		if((i < cntJointIndex) && meshHasJointIndex && VD->JointIndex.hasIt) {
-			glm::uvec4 jointIndex = {
-				(glm::uint)bufferJointIndex[4 * i + 0],
-				(glm::uint)bufferJointIndex[4 * i + 1],
-				(glm::uint)bufferJointIndex[4 * i + 2],
-				(glm::uint)bufferJointIndex[4 * i + 3]
-			};
-//std::cout << jointIndex.x << " " << jointIndex.y << " " << jointIndex.z << " " << jointIndex.w << "\t\t";
-
-//usedIndices[jointIndex.x] = true;
-//usedIndices[jointIndex.y] = true;
-//usedIndices[jointIndex.z] = true;
-//usedIndices[jointIndex.w] = true;
+void Model::makeGLTFMesh(tinygltf::Model *M, const tinygltf::Primitive *Prm) {
+	int mainStride = VD->Bindings[0].stride;
 
-			glm::uvec4 *o = (glm::uvec4 *)((char*)(&vertex[0]) + VD->JointIndex.offset);
-			*o = jointIndex;
+	struct GLTFAttribute {
+		const char *name;
+		const char *label;
+		VertexComponent *component;
+		int components;
+		bool isUint;
+		const tinygltf::Accessor *accessor;
+	};
+	GLTFAttribute attributes[] = {
+		{"POSITION",   "position", &VD->Position,    3, false, nullptr},
+		{"NORMAL",     "normal",   &VD->Normal,      3, false, nullptr},
+		{"TANGENT",    "tangent",  &VD->Tangent,     4, false, nullptr},
+		{"TEXCOORD_0", "UV",       &VD->UV,          2, false, nullptr},
+		{"JOINTS_0",   "Joint",    &VD->JointIndex,  4, true,  nullptr},
+		{"WEIGHTS_0",  "Weights",  &VD->JointWeight, 4, false, nullptr}
+	};
+	
+	int cntTot = 0;
+	for(GLTFAttribute &A : attributes) {
+		auto it = Prm->attributes.find(A.name);
+		if(it != Prm->attributes.end()) {
+			A.accessor = &M->accessors[it->second];
+			cntTot = std::max(cntTot, (int)A.accessor->count);
+		} else if(A.component->hasIt) {
+			std::cout << ("Warning: vertex layout has " + std::string(A.label) + ", but file hasn't\n");
 		}
+	}
 
-		if((i < cntJointWeight) && meshHasJointWeight && VD->JointWeight.hasIt) {
-			glm::vec4 jointWeight = {
-				bufferJointWeight[4 * i + 0],
-				bufferJointWeight[4 * i + 1],
-				bufferJointWeight[4 * i + 2],
-				bufferJointWeight[4 * i + 3]
-			};
-//std::cout << bufferJointWeight[4 * i + 0] << " " << bufferJointWeight[4 * i + 1] << " " << bufferJointWeight[4 * i + 2] << " " << 
-//				bufferJointWeight[4 * i + 3] << "\n";
-
-			glm::vec4 *o = (glm::vec4 *)((char*)(&vertex[0]) + VD->JointWeight.offset);
-			*o = jointWeight;
+	// the vertices are zeroed, then filled one attribute at a time
+	size_t base = vertices.size();
+	vertices.resize(base + (size_t)cntTot * mainStride, 0);
+	for(GLTFAttribute &A : attributes) {
+		if((A.accessor != nullptr) && A.component->hasIt && (cntTot > 0)) {
+			copyGLTFAttribute(M, *A.accessor, A.components, A.isUint,
+							  &vertices[base] + A.component->offset, mainStride);
 		}
-
-//std::cout << vertices.size() << "," << vertex.size() << " Inserting\n";
-		vertices.insert(vertices.end(), vertex.begin(), vertex.end());
-//std::cout << vertices.size() << " Inserted\n";
-	} 
-
-//std::cout << "Used indices: " << usedIndices.size() << "\n";
-//for(auto kkk: usedIndices) {
-//	std::cout << kkk.first << ", ";
-//}
-//std::cout << "\n";
+	}
 
 	const tinygltf::Accessor &accessor = M->accessors[Prm->indices];
 	const tinygltf::BufferView &bufferView = M->bufferViews[accessor.bufferView];
 	const tinygltf::Buffer &buffer = M->buffers[bufferView.buffer];
+	const unsigned char *bufferIndex = &(buffer.data[accessor.byteOffset + bufferView.byteOffset]);
+	size_t firstIndex = indices.size();
 	
 	switch(accessor.componentType) {
+		case TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE:
+			indices.resize(firstIndex + accessor.count);
+			convertGLTFToUint<uint8_t>(bufferIndex, 1, 1,
+					reinterpret_cast<unsigned char *>(&indices[firstIndex]), sizeof(uint32_t), accessor.count);
+			break;
 		case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT:
-			{
-				const uint16_t *bufferIndex = reinterpret_cast<const uint16_t *>(&(buffer.data[accessor.byteOffset + bufferView.byteOffset]));
-				for(int i = 0; i < accessor.count; i++) {
-					indices.push_back(bufferIndex[i]);
-				}
-			}
+			indices.resize(firstIndex + accessor.count);
+			convertGLTFToUint<uint16_t>(bufferIndex, sizeof(uint16_t), 1,
+					reinterpret_cast<unsigned char *>(&indices[firstIndex]), sizeof(uint32_t), accessor.count);
 			break;
 		case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT:
-			{
-				const uint32_t *bufferIndex = reinterpret_cast<const uint32_t *>(&(buffer.data[accessor.byteOffset + bufferView.byteOffset]));
-				for(int i = 0; i < accessor.count; i++) {
-					indices.push_back(bufferIndex[i]);
-				}
-			}
+			indices.resize(firstIndex + accessor.count);
+			memcpy(&indices[firstIndex], bufferIndex, accessor.count * sizeof(uint32_t));
 			break;
 		default:
 			std::cerr << "Index component type " << accessor.componentType << " not supported!" << std::endl;
@@ -3178,8 +4556,39 @@ void Model::makeGLTFMesh(tinygltf::Model *M, const tinygltf::Primitive *Prm) {
 	}			
 }
 
-
-void Model::getGLTFnodeTransforms(const tinygltf::Node *N, 	glm::vec3 &T, glm::vec3 &S, glm::quat &Q) {
+// Times makeGLTFMesh() on all the primitives of a glTF file
+void Model::benchmarkGLTFMesh(std::string file, VertexDescriptor *VD, int iterations) {
+	AssetFile AF;
+	AF.init(file, GLTF);
+	
+	size_t vertexCount = 0;
+	size_t bytes = 0;
+	auto startTime = std::chrono::high_resolution_clock::now();
+	for(int it = 0; it < iterations; it++) {
+		Model M;
+		M.VD = VD;
+		for (const auto& mesh :  AF.model.meshes) {
+			for (const auto& primitive :  mesh.primitives) {
+				if (primitive.indices >= 0) {
+					M.makeGLTFMesh(&AF.model, &primitive);
+				}
+			}
+		}
+		vertexCount = M.vertices.size() / VD->Bindings[0].stride;
+		bytes = M.vertices.size() + M.indices.size() * sizeof(uint32_t);
+	}
+	auto endTime = std::chrono::high_resolution_clock::now();
+	float totalMs = std::chrono::duration<float, std::chrono::milliseconds::period>
+				(endTime - startTime).count();
+	
+	std::cout << "Mesh benchmark: " << file << ", " << vertexCount << " vertices, "
+			  << iterations << " iterations, " << totalMs / iterations << " ms/mesh, "
+			  << (bytes * iterations) / (totalMs * 1000.0f) << " MB/s\n";
+	AF.cleanup();
+}
+
+
+void Model::getGLTFnodeTransforms(const tinygltf::Node *N, 	glm::vec3 &T, glm::vec3 &S, glm::quat &Q) {
 	if(N->translation.size() > 0) {
 //std::cout << "node " << i << " has T\n";
 		T = glm::vec3(N->translation[0],
@@ -3223,51 +4632,15 @@ void Model::makeGLTFwm(const tinygltf::Node *N) {
 }
 
 void Model::loadModelGLTF(std::string file, bool encoded) {
-	tinygltf::Model model;
-	tinygltf::TinyGLTF loader;
-	std::string warn, err;
-	
-	std::cout << "Loading : " << file << (encoded ? "[MGCG]" : "[GLTF]") << "\n";	
-	if(encoded) {
-		auto modelString = readFile(file);
-		
-		const std::vector<unsigned char> key = plusaes::key_from_string(&"CG2023SkelKey128"); // 16-char = 128-bit
-		const unsigned char iv[16] = {
-			0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-			0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
-		};
-
-		// decrypt
-		unsigned long padded_size = 0;
-		std::vector<unsigned char> decrypted(modelString.size());
-
-		plusaes::decrypt_cbc((unsigned char*)modelString.data(), modelString.size(), &key[0], key.size(), &iv, &decrypted[0], decrypted.size(), &padded_size);
-
-		int size = 0;
-		void *decomp;
-		
-		sscanf(reinterpret_cast<char *const>(&decrypted[0]), "%d", &size);
-//std::cout << decrypted.size() << ", decomp: " << size << "\n";
-//for(int i=0;i<32;i++) {
-//	std::cout << (int)decrypted[i] << "\n";
-//}
-
-		decomp = calloc(size, 1);
-		int n = sinflate(decomp, (int)size, &decrypted[16], decrypted.size()-16);
-		
-		if (!loader.LoadASCIIFromString(&model, &warn, &err, 
-						reinterpret_cast<const char *>(decomp), size, "/")) {
-			throw std::runtime_error(warn + err);
-		}
-	} else {
-		if (!loader.LoadASCIIFromFile(&model, &warn, &err, 
-						file.c_str())) {
-			throw std::runtime_error(warn + err);
-		}
-	}
+	// models are loaded by several threads: the log is written at once
+	std::ostringstream log;
+	log << "Loading : " << file << (encoded ? "[MGCG]" : "[GLTF]") << "\n";	
+	// the file is parsed only if no one else is holding it
+	AssetFile *AF = BP->assetRegistry.acquire(file, encoded ? MGCG : GLTF);
+	tinygltf::Model &model = AF->model;
 
 	for (const auto& mesh :  model.meshes) {
-		std::cout << "Primitives: " << mesh.primitives.size() << "\n";
+		log << "Primitives: " << mesh.primitives.size() << "\n";
 		for (const auto& primitive :  mesh.primitives) {
 			if (primitive.indices < 0) {
 				continue;
@@ -3277,43 +4650,275 @@ void Model::loadModelGLTF(std::string file, bool encoded) {
 		}
 	}
 
-	std::cout << (encoded ? "[MGCG]" : "[GLTF]") << " Vertices: " << (vertices.size()/VD->Bindings[0].stride)
-			  << " Indices: " << indices.size() << "\n";
+	log << (encoded ? "[MGCG]" : "[GLTF]") << " Vertices: " << (vertices.size()/VD->Bindings[0].stride)
+		<< " Indices: " << indices.size() << "\n";
+	std::cout << log.str();
 /*
 std::cout << model.nodes[0].translation.size() << "\n";
 std::cout << model.nodes[0].rotation.size() << "\n";
 std::cout << model.nodes[0].scale.size() << "\n";
 */
 	makeGLTFwm(&model.nodes[0]);
+	BP->assetRegistry.release(AF);
+}
+
+size_t Model::vertexDataSize() {
+	if(cacheFile != nullptr) {
+		return reinterpret_cast<const MeshCacheHeader *>(cacheFile->data)->vertexBytes;
+	}
+	return vertices.size();
+}
+
+const uint32_t *Model::indexData() {
+	if(cacheFile != nullptr) {
+		size_t offset = (sizeof(MeshCacheHeader) + vertexDataSize() + 3) & ~(size_t)3;
+		return reinterpret_cast<const uint32_t *>(cacheFile->data + offset);
+	}
+	return indices.data();
+}
+
+size_t Model::indexCount() {
+	if(cacheFile != nullptr) {
+		return reinterpret_cast<const MeshCacheHeader *>(cacheFile->data)->indexCount;
+	}
+	return indices.size();
+}
+
+// FNV-1a of the source file, of the external buffers it references, of the
+// vertex layout and of the format of the cache: any change gives a
+// different file name
+uint64_t Model::meshCacheKey(const std::string &file, const std::vector<char> &source,
+							 VertexDescriptor *VD, bool encoded) {
+	uint64_t key = 14695981039346656037ull;
+	auto mix = [&key](const void *data, size_t size) {
+		const unsigned char *bytes = static_cast<const unsigned char *>(data);
+		for(size_t i = 0; i < size; i++) {
+			key = (key ^ bytes[i]) * 1099511628211ull;
+		}
+	};
+	const uint32_t version = 3;
+	mix(&version, sizeof(version));
+	mix(&encoded, sizeof(encoded));
+	mix(source.data(), source.size());
+	if(!encoded) {
+		// a .gltf file can keep its geometry in .bin files next to it
+		// (MGCG files embed everything)
+		nlohmann::json js = nlohmann::json::parse(source.begin(), source.end(), nullptr, false);
+		if(js.is_object() && js["buffers"].is_array()) {
+			std::filesystem::path baseDir = std::filesystem::path(file).parent_path();
+			for(auto &B : js["buffers"]) {
+				if(!B["uri"].is_string()) {
+					continue;
+				}
+				std::string uri = B["uri"].get<std::string>();
+				if(uri.compare(0, 5, "data:") == 0) {
+					continue;
+				}
+				mix(uri.data(), uri.size());
+				std::ifstream in(baseDir / uri, std::ios::binary);
+				std::vector<char> bytes((std::istreambuf_iterator<char>(in)),
+										 std::istreambuf_iterator<char>());
+				mix(bytes.data(), bytes.size());
+			}
+		}
+	}
+	for(auto &B : VD->Bindings) {
+		mix(&B.binding, sizeof(B.binding));
+		mix(&B.stride, sizeof(B.stride));
+		mix(&B.inputRate, sizeof(B.inputRate));
+	}
+	for(auto &E : VD->Layout) {
+		mix(&E.binding, sizeof(E.binding));
+		mix(&E.location, sizeof(E.location));
+		mix(&E.format, sizeof(E.format));
+		mix(&E.offset, sizeof(E.offset));
+		mix(&E.size, sizeof(E.size));
+		mix(&E.usage, sizeof(E.usage));
+	}
+	const VertexComponent *C[] = {&VD->Position, &VD->Pos2D, &VD->Normal, &VD->UV,
+								  &VD->Color, &VD->Tangent, &VD->JointWeight, &VD->JointIndex};
+	for(const VertexComponent *VC : C) {
+		mix(&VC->hasIt, sizeof(VC->hasIt));
+		mix(&VC->offset, sizeof(VC->offset));
+	}
+	return key;
+}
+
+bool Model::loadMeshCache(const std::string &name, uint64_t key) {
+	MappedFile *MF = new MappedFile();
+	if(!MF->open(name)) {
+		delete MF;
+		return false;
+	}
+	
+	const MeshCacheHeader *H = reinterpret_cast<const MeshCacheHeader *>(MF->data);
+	bool valid = (MF->size >= sizeof(MeshCacheHeader)) &&
+				 (memcmp(H->magic, "MGMESH", 7) == 0) &&
+				 (H->version == 1) && (H->key == key);
+	if(valid) {
+		size_t indexOffset = (sizeof(MeshCacheHeader) + H->vertexBytes + 3) & ~(size_t)3;
+		valid = (indexOffset + H->indexCount * sizeof(uint32_t) <= MF->size);
+	}
+	if(!valid) {
+		std::cout << ("Ignoring invalid mesh cache file: " + name + "\n");
+		MF->close();
+		delete MF;
+		return false;
+	}
+	
+	memcpy(&Wm, H->Wm, sizeof(H->Wm));
+	vertices.clear();
+	indices.clear();
+	cacheFile = MF;
+	return true;
+}
+
+// The file is written under a temporary name and then renamed, so that
+// models loaded at the same time never see it half written
+void Model::saveMeshCache(const std::string &name, uint64_t key) {
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(name).parent_path(), ec);
+	
+	MeshCacheHeader H{};
+	memcpy(H.magic, "MGMESH", 7);
+	H.version = 1;
+	H.key = key;
+	H.vertexBytes = vertices.size();
+	H.indexCount = indices.size();
+	memcpy(H.Wm, &Wm, sizeof(H.Wm));
+	
+	std::ostringstream tmpName;
+	tmpName << name << ".tmp" << std::hash<std::thread::id>()(std::this_thread::get_id());
+	std::ofstream out(tmpName.str(), std::ios::binary);
+	if(!out.is_open()) {
+		return;
+	}
+	const char padding[4] = {0, 0, 0, 0};
+	out.write(reinterpret_cast<const char *>(&H), sizeof(H));
+	out.write(reinterpret_cast<const char *>(vertices.data()), vertices.size());
+	out.write(padding, ((sizeof(H) + vertices.size() + 3) & ~(size_t)3) - (sizeof(H) + vertices.size()));
+	out.write(reinterpret_cast<const char *>(indices.data()), indices.size() * sizeof(uint32_t));
+	out.close();
+	
+	if(out.fail()) {
+		std::filesystem::remove(tmpName.str(), ec);
+		return;
+	}
+	std::filesystem::rename(tmpName.str(), name, ec);
+	if(ec) {
+		std::filesystem::remove(tmpName.str(), ec);
+	}
+}
+
+void Model::loadModelGLTFCached(std::string file, bool encoded) {
+	if(BP->meshCacheDir.empty()) {
+		loadModelGLTF(file, encoded);
+		return;
+	}
+	
+	uint64_t key = meshCacheKey(file, readFile(file), VD, encoded);
+	std::ostringstream name;
+	name << BP->meshCacheDir << "/" << std::hex << std::setw(16) << std::setfill('0')
+		 << key << ".mesh";
+	if(loadMeshCache(name.str(), key)) {
+		std::cout << ("Loading : " + file + (encoded ? "[MGCG]" : "[GLTF]") + " from cache\n");
+		return;
+	}
+	
+	loadModelGLTF(file, encoded);
+	saveMeshCache(name.str(), key);
+}
+
+bool MappedFile::open(const std::string &name) {
+#ifdef _WIN32
+	std::ifstream file(name, std::ios::ate | std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+	size = (size_t) file.tellg();
+	buffer.resize(size);
+	file.seekg(0);
+	file.read(reinterpret_cast<char *>(buffer.data()), size);
+	data = buffer.data();
+	return !file.fail();
+#else
+	int fd = ::open(name.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+		::close(fd);
+		return false;
+	}
+	void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// the mapping stays valid after the descriptor is closed
+	::close(fd);
+	if(ptr == MAP_FAILED) {
+		return false;
+	}
+	data = static_cast<const unsigned char *>(ptr);
+	size = st.st_size;
+	return true;
+#endif
+}
+
+void MappedFile::close() {
+#ifdef _WIN32
+	buffer.clear();
+	buffer.shrink_to_fit();
+#else
+	if(data != nullptr) {
+		munmap(const_cast<unsigned char *>(data), size);
+	}
+#endif
+	data = nullptr;
+	size = 0;
 }
 
 void Model::createVertexBuffer() {
 //	VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-	VkDeviceSize bufferSize = vertices.size();
+	VkDeviceSize bufferSize = vertexDataSize();
+
+	if(hostVisible || BP->memoryAllocator.unifiedMemory) {
+		BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
+							VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+							VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+							(BP->memoryAllocator.unifiedMemory ? VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT : 0),
+							vertexBuffer, vertexBufferMemory,
+							GMT_MESH, hostVisible ? GML_TRANSIENT : GML_STATIC);
 
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
-						VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-						VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-						vertexBuffer, vertexBufferMemory);
+		memcpy(vertexBufferMemory.mapped, vertexData(), (size_t) bufferSize);
+	} else {
+		BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+							VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+							VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+							vertexBuffer, vertexBufferMemory, GMT_MESH);
 
-	void* data;
-	vkMapMemory(BP->device, vertexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, vertices.data(), (size_t) bufferSize);
-	vkUnmapMemory(BP->device, vertexBufferMemory);			
+		BP->stagingUploader.uploadBuffer(vertexBuffer, vertexData(), bufferSize);
+	}
 }
 
 void Model::createIndexBuffer() {
-	VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
+	VkDeviceSize bufferSize = sizeof(uint32_t) * indexCount();
 
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-							 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-							 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-							 indexBuffer, indexBufferMemory);
+	if(hostVisible || BP->memoryAllocator.unifiedMemory) {
+		BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+								 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+								 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+								 (BP->memoryAllocator.unifiedMemory ? VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT : 0),
+								 indexBuffer, indexBufferMemory,
+								 GMT_MESH, hostVisible ? GML_TRANSIENT : GML_STATIC);
 
-	void* data;
-	vkMapMemory(BP->device, indexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, indices.data(), (size_t) bufferSize);
-	vkUnmapMemory(BP->device, indexBufferMemory);
+		memcpy(indexBufferMemory.mapped, indexData(), (size_t) bufferSize);
+	} else {
+		BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+								 VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+								 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+								 indexBuffer, indexBufferMemory, GMT_MESH);
+
+		BP->stagingUploader.uploadBuffer(indexBuffer, indexData(), bufferSize);
+	}
 }
 
 void Model::initMesh(BaseProject *bp, VertexDescriptor *vd, bool printDebug) {
@@ -3324,12 +4929,31 @@ void Model::initMesh(BaseProject *bp, VertexDescriptor *vd, bool printDebug) {
 		std::cout << "[Manual] Vertices: " << (vertices.size()/mainStride)
 				  << " Indices: " << indices.size() << "\n";
 	}
-	createVertexBuffer();
-	createIndexBuffer();
+	if(ownBuffers) {
+		createVertexBuffer();
+		createIndexBuffer();
+	}
 	Wm = glm::mat4(1);
 }
 
 void Model::init(BaseProject *bp, VertexDescriptor *vd, std::string file, ModelType MT) {
+	load(bp, vd, file, MT);
+	upload();
+}
+
+void Model::initFromAsset(BaseProject *bp, VertexDescriptor *vd, AssetFile *AF, std::string AN, int Mid, std::string NN) {
+	loadFromAsset(bp, vd, AF, AN, Mid, NN);
+	upload();
+}
+
+void Model::upload() {
+	if(ownBuffers) {
+		createVertexBuffer();
+		createIndexBuffer();
+	}
+}
+
+void Model::load(BaseProject *bp, VertexDescriptor *vd, std::string file, ModelType MT) {
 	BP = bp;
 	VD = vd;
 	Wm = glm::mat4(1);
@@ -3337,22 +4961,20 @@ void Model::init(BaseProject *bp, VertexDescriptor *vd, std::string file, ModelT
 	if(MT == OBJ) {
 		loadModelOBJ(file);
 	} else if(MT == GLTF) {
-		loadModelGLTF(file, false);
+		loadModelGLTFCached(file, false);
 	} else if(MT == MGCG) {
-		loadModelGLTF(file, true);
+		loadModelGLTFCached(file, true);
 	}
-	
-	createVertexBuffer();
-	createIndexBuffer();
 }
 
-void Model::initFromAsset(BaseProject *bp, VertexDescriptor *vd, AssetFile *AF, std::string AN, int Mid, std::string NN) {
+void Model::loadFromAsset(BaseProject *bp, VertexDescriptor *vd, AssetFile *AF, std::string AN, int Mid, std::string NN) {
 	BP = bp;
 	VD = vd;
 	Wm = glm::mat4(1);
 
 	switch(AF->type) {
 	  case GLTF:
+	  case MGCG:
    	    {
    	      const tinygltf::Primitive *Prm;
    		  auto el = AF->GLTFmeshes.find(AN);
@@ -3361,17 +4983,17 @@ void Model::initFromAsset(BaseProject *bp, VertexDescriptor *vd, AssetFile *AF,
    		  	if((Mid >= 0) && (Mid < P.size())) {
    		  		makeGLTFMesh(&AF->model, P[Mid]);
    		  	} else {
-   		  		std::cout << "Asset >" << AN << "< does not have component: " << Mid << "\n";
+   		  		std::cout << ("Asset >" + AN + "< does not have component: " + std::to_string(Mid) + "\n");
    		  	}
    		  } else {
-   		  	std::cout << "Asset does not contain Mesh: " << AN << "\n";
+   		  	std::cout << ("Asset does not contain Mesh: " + AN + "\n");
    		  }
 		  if(NN != "") {
 			  auto nel = AF->GLTFnodes.find(NN);
 			  if(nel != AF->GLTFnodes.end()) {
 				  makeGLTFwm(nel->second);
 			  } else {
-				std::cout << "Asset does not contain Node: " << NN << "\n";
+				std::cout << ("Asset does not contain Node: " + NN + "\n");
 			  }
 		  }
    	    }
@@ -3386,26 +5008,32 @@ void Model::initFromAsset(BaseProject *bp, VertexDescriptor *vd, AssetFile *AF,
    		  		std::cout << "OBJ assets can only be single material\n";
    		  	} else {
    		  		makeOBJMesh(Prm, &AF->attrib);
+   		  		vertices.shrink_to_fit();
    		  	}
    		  } else {
-   		  	std::cout << "Asset does not contain Mesh: " << AN << "\n";
+   		  	std::cout << ("Asset does not contain Mesh: " + AN + "\n");
    		  }
    	    }
 		break;
 	  default:
-	    std::cout << "Unknown asset file type: " << AF->type << "\n";
+	    std::cout << ("Unknown asset file type: " + std::to_string(AF->type) + "\n");
 	    break;
 	}
-
-	createVertexBuffer();
-	createIndexBuffer();
 }
 
 void Model::cleanup() {
-   	vkDestroyBuffer(BP->device, indexBuffer, nullptr);
-   	vkFreeMemory(BP->device, indexBufferMemory, nullptr);
-	vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
-   	vkFreeMemory(BP->device, vertexBufferMemory, nullptr);
+	if(cacheFile != nullptr) {
+		cacheFile->close();
+		delete cacheFile;
+		cacheFile = nullptr;
+	}
+	if(!ownBuffers) {
+		return;
+	}
+   	vkDestroyBuffer(BP->device, indexBuffer, BP->allocationCallbacks);
+   	BP->memoryAllocator.free(indexBufferMemory);
+	vkDestroyBuffer(BP->device, vertexBuffer, BP->allocationCallbacks);
+   	BP->memoryAllocator.free(vertexBufferMemory);
 }
 
 void Model::bind(VkCommandBuffer commandBuffer) {
@@ -3424,19 +5052,30 @@ void Model::bind(VkCommandBuffer commandBuffer) {
 
 
 void Texture::createTextureImage(std::vector<std::string>files, VkFormat Fmt) {
-	int texWidth, texHeight, texChannels;
+	loadImages(files);
+	uploadTextureImage(Fmt);
+}
+
+void Texture::loadImages(std::vector<std::string>files) {
+	int texChannels;
 	int curWidth = -1, curHeight = -1, curChannels = -1;
-	stbi_uc* pixels[maxImgs];
 	
+	imgs = files.size();
+	if(imgs > maxImgs) {
+		throw std::runtime_error("too many images for a texture!");
+	}
 	for(int i = 0; i < imgs; i++) {
 	 	pixels[i] = stbi_load(files[i].c_str(), &texWidth, &texHeight,
 						&texChannels, STBI_rgb_alpha);
 		if (!pixels[i]) {
-			std::cout << "Not found: " << files[i] << "\n";
+			std::cout << ("Not found: " + files[i] + "\n");
 			throw std::runtime_error("failed to load texture image!");
 		}
-		std::cout << "[" << i << "]" << files[i] << " -> size: " << texWidth
-				  << "x" << texHeight << ", ch: " << texChannels <<"\n";
+		// textures are loaded by several threads: each line is written at once
+		std::ostringstream log;
+		log << "[" << i << "]" << files[i] << " -> size: " << texWidth
+			<< "x" << texHeight << ", ch: " << texChannels <<"\n";
+		std::cout << log.str();
 				  
 		if(i == 0) {
 			curWidth = texWidth;
@@ -3450,26 +5089,27 @@ void Texture::createTextureImage(std::vector<std::string>files, VkFormat Fmt) {
 			}
 		}
 	}
-	
+}
+
+void Texture::uploadTextureImage(VkFormat Fmt) {
 	VkDeviceSize imageSize = texWidth * texHeight * 4;
 	VkDeviceSize totalImageSize = texWidth * texHeight * 4 * imgs;
 	mipLevels = static_cast<uint32_t>(std::floor(
 					std::log2(std::max(texWidth, texHeight)))) + 1;
 	
 	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
+	GPUAllocation stagingBufferMemory;
 	 
 	BP->createBuffer(totalImageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 	  						VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
 	  						VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-	  						stagingBuffer, stagingBufferMemory);
-	void* data;
-	vkMapMemory(BP->device, stagingBufferMemory, 0, totalImageSize, 0, &data);
+	  						stagingBuffer, stagingBufferMemory,
+	  						GMT_STAGING, GML_TRANSIENT);
+	void* data = stagingBufferMemory.mapped;
 	for(int i = 0; i < imgs; i++) {
 		memcpy(static_cast<char *>(data) + imageSize * i, pixels[i], static_cast<size_t>(imageSize));
 		stbi_image_free(pixels[i]);
 	}
-	vkUnmapMemory(BP->device, stagingBufferMemory);
 	
 	
 	BP->createImage(texWidth, texHeight, mipLevels, imgs, VK_SAMPLE_COUNT_1_BIT, Fmt,
@@ -3477,7 +5117,7 @@ void Texture::createTextureImage(std::vector<std::string>files, VkFormat Fmt) {
 				VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
 				imgs == 6 ? VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT : 0,
 				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage,
-				textureImageMemory);
+				textureImageMemory, GMT_TEXTURE);
 				
 	BP->transitionImageLayout(textureImage, Fmt,
 			VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels, imgs);
@@ -3487,8 +5127,8 @@ void Texture::createTextureImage(std::vector<std::string>files, VkFormat Fmt) {
 	BP->generateMipmaps(textureImage, Fmt,
 					texWidth, texHeight, mipLevels, imgs);
 
-	vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
-	vkFreeMemory(BP->device, stagingBufferMemory, nullptr);
+	vkDestroyBuffer(BP->device, stagingBuffer, BP->allocationCallbacks);
+	BP->memoryAllocator.free(stagingBufferMemory);
 }
 
 void Texture::createTextureImageView(VkFormat Fmt) {
@@ -3526,7 +5166,7 @@ void Texture::createTextureSampler(VkFilter magFilter,
 	samplerInfo.minLod = 0.0f;
 	samplerInfo.maxLod = ((maxLod == -1) ? static_cast<float>(mipLevels) : maxLod);
 	
-	VkResult result = vkCreateSampler(BP->device, &samplerInfo, nullptr,
+	VkResult result = vkCreateSampler(BP->device, &samplerInfo, BP->allocationCallbacks,
 									  &textureSampler);
 	if (result != VK_SUCCESS) {
 	 	PrintVkError(result);
@@ -3559,15 +5199,24 @@ void Texture::initCubic(BaseProject *bp, std::vector<std::string>files, VkFormat
 	createTextureSampler();
 }
 
+void Texture::initFromImages(BaseProject *bp, VkFormat Fmt, bool initSampler) {
+	BP = bp;
+	uploadTextureImage(Fmt);
+	createTextureImageView(Fmt);
+	if(initSampler) {
+		createTextureSampler();
+	}
+}
+
 VkDescriptorImageInfo Texture::getViewAndSampler() {
 	return {textureSampler, textureImageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
 }
 
 void Texture::cleanup() {
-   	vkDestroySampler(BP->device, textureSampler, nullptr);
-   	vkDestroyImageView(BP->device, textureImageView, nullptr);
-	vkDestroyImage(BP->device, textureImage, nullptr);
-	vkFreeMemory(BP->device, textureImageMemory, nullptr);
+   	vkDestroySampler(BP->device, textureSampler, BP->allocationCallbacks);
+   	vkDestroyImageView(BP->device, textureImageView, BP->allocationCallbacks);
+	vkDestroyImage(BP->device, textureImage, BP->allocationCallbacks);
+	BP->memoryAllocator.free(textureImageMemory);
 }
 
 
@@ -3604,7 +5253,7 @@ VkFilter magFilter,
 	samplerInfo.minLod = 0.0f;
 	samplerInfo.maxLod = 1.0f;
 	
-	VkResult result = vkCreateSampler(BP->device, &samplerInfo, nullptr,
+	VkResult result = vkCreateSampler(BP->device, &samplerInfo, BP->allocationCallbacks,
 									  &sampler);
 	if (result != VK_SUCCESS) {
 	 	PrintVkError(result);
@@ -3636,7 +5285,7 @@ void FrameBufferAttachment::createResources() {
 				samples, format, VK_IMAGE_TILING_OPTIMAL,
 				usage, 0, 
 				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-				image, mem);
+				image, mem, GMT_ATTACHMENT, GML_SWAPCHAIN);
 	view = BP->createImageView(image, format,
 								aspect, 1,
 								VK_IMAGE_VIEW_TYPE_2D, 1);
@@ -3682,16 +5331,16 @@ void FrameBufferAttachment::cleanup() {
 //std::cout << "Cleaning up render pass attchment " << properties->swapChain << " " << properties->type << " " << properties->usage << "\n";
 
 	if(!properties->swapChain) {
-		vkDestroyImageView(BP->device, view, nullptr);
-		vkDestroyImage(BP->device, image, nullptr);
-		vkFreeMemory(BP->device, mem, nullptr);
+		vkDestroyImageView(BP->device, view, BP->allocationCallbacks);
+		vkDestroyImage(BP->device, image, BP->allocationCallbacks);
+		BP->memoryAllocator.free(mem);
 	}
 }
 
 void FrameBufferAttachment::destroy() {
 	BaseProject *BP = RP->BP;
 	if(freeSampler) {
-		vkDestroySampler(BP->device, sampler, nullptr);
+		vkDestroySampler(BP->device, sampler, BP->allocationCallbacks);
 	}
 }
 
@@ -3700,7 +5349,13 @@ void FrameBufferAttachment::destroy() {
 
 
 void RenderPass::init(BaseProject *bp, int w, int h, int _count, std::vector <AttachmentProperties> *p, std::vector<VkSubpassDependency> *d, bool initSampler) {
+	static int RPcount = 0;
+	
 	BP = bp;
+	if(name.empty()) {
+		name = "RenderPass " + std::to_string(RPcount);
+	}
+	RPcount++;
 	width = (w > 0 ? w : BP->swapChainExtent.width);
 	height = (h > 0 ? h : BP->swapChainExtent.height);
 	count = (_count > 0 ? _count : BP->swapChainImageViews.size());
@@ -3772,7 +5427,7 @@ void RenderPass::createRenderPass() {
 	renderPassInfo.dependencyCount = dependencies.size();
 	renderPassInfo.pDependencies = dependencies.data();
 
-	VkResult result = vkCreateRenderPass(BP->device, &renderPassInfo, nullptr,
+	VkResult result = vkCreateRenderPass(BP->device, &renderPassInfo, BP->allocationCallbacks,
 				&renderPass);
 	if (result != VK_SUCCESS) {
 		PrintVkError(result);
@@ -3801,7 +5456,7 @@ void RenderPass::createFramebuffers() {
 		framebufferInfo.height = height;
 		framebufferInfo.layers = 1;
 		
-		VkResult result = vkCreateFramebuffer(BP->device, &framebufferInfo, nullptr,
+		VkResult result = vkCreateFramebuffer(BP->device, &framebufferInfo, BP->allocationCallbacks,
 					&frameBuffers[i]);
 		if (result != VK_SUCCESS) {
 			PrintVkError(result);
@@ -3840,24 +5495,49 @@ void RenderPass::begin(VkCommandBuffer commandBuffer, int currentImage) {
 					static_cast<uint32_t>(clearValues.size());
 	renderPassInfo.pClearValues = clearValues.data();
 	
+	profScope = BP->gpuProfiler.beginScope(commandBuffer, currentImage, name);
+	profImage = currentImage;
+	
+	pendingSecondary.clear();
 	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
-			VK_SUBPASS_CONTENTS_INLINE);
+			secondaryContents ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS :
+								VK_SUBPASS_CONTENTS_INLINE);
 }
 
 void RenderPass::end(VkCommandBuffer commandBuffer) {
+	if(!pendingSecondary.empty()) {
+		vkCmdExecuteCommands(commandBuffer, pendingSecondary.size(),
+							 pendingSecondary.data());
+		pendingSecondary.clear();
+	}
 	vkCmdEndRenderPass(commandBuffer);
+	
+	BP->gpuProfiler.endScope(commandBuffer, profImage, profScope);
+}
+
+void RenderPass::addSecondary(VkCommandBuffer commandBuffer) {
+	pendingSecondary.push_back(commandBuffer);
+}
+
+VkCommandBufferInheritanceInfo RenderPass::getInheritanceInfo(int currentImage) {
+	VkCommandBufferInheritanceInfo inheritanceInfo{};
+	inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritanceInfo.renderPass = renderPass;
+	inheritanceInfo.subpass = 0;
+	inheritanceInfo.framebuffer = frameBuffers[currentImage];
+	return inheritanceInfo;
 }
 
 void RenderPass::cleanup() {
 	for (size_t i = 0; i < frameBuffers.size(); i++) {
-		vkDestroyFramebuffer(BP->device, frameBuffers[i], nullptr);
+		vkDestroyFramebuffer(BP->device, frameBuffers[i], BP->allocationCallbacks);
 	}
 		
 	for(int i = 0; i < attachments.size(); i++) {
 		attachments[i].cleanup();
 	}
 	
-	vkDestroyRenderPass(BP->device, renderPass, nullptr);
+	vkDestroyRenderPass(BP->device, renderPass, BP->allocationCallbacks);
 }
 
 void RenderPass::destroy() {
@@ -4250,7 +5930,7 @@ void Pipeline::create(RenderPass *RP) {
 	pipelineLayoutInfo.pPushConstantRanges = PK.data();
 //std::cout << "Push constant ranges: " << PK.size() << "\n";
 	
-	VkResult result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
+	VkResult result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, BP->allocationCallbacks,
 				&pipelineLayout);
 	if (result != VK_SUCCESS) {
 	 	PrintVkError(result);
@@ -4290,7 +5970,7 @@ void Pipeline::create(RenderPass *RP) {
 	pipelineInfo.basePipelineIndex = -1; // Optional
 	
 	result = vkCreateGraphicsPipelines(BP->device, VK_NULL_HANDLE, 1,
-			&pipelineInfo, nullptr, &graphicsPipeline);
+			&pipelineInfo, BP->allocationCallbacks, &graphicsPipeline);
 	if (result != VK_SUCCESS) {
 	 	PrintVkError(result);
 		throw std::runtime_error("failed to create graphics pipeline!");
@@ -4299,8 +5979,8 @@ void Pipeline::create(RenderPass *RP) {
 }
 
 void Pipeline::destroy() {
-	vkDestroyShaderModule(BP->device, fragShaderModule, nullptr);
-	vkDestroyShaderModule(BP->device, vertShaderModule, nullptr);
+	vkDestroyShaderModule(BP->device, fragShaderModule, BP->allocationCallbacks);
+	vkDestroyShaderModule(BP->device, vertShaderModule, BP->allocationCallbacks);
 }	
 
 void Pipeline::bind(VkCommandBuffer commandBuffer) {
@@ -4318,7 +5998,7 @@ VkShaderModule Pipeline::createShaderModule(const std::vector<char>& code) {
 	
 	VkShaderModule shaderModule;
 
-	VkResult result = vkCreateShaderModule(BP->device, &createInfo, nullptr,
+	VkResult result = vkCreateShaderModule(BP->device, &createInfo, BP->allocationCallbacks,
 					&shaderModule);
 	if (result != VK_SUCCESS) {
 	 	PrintVkError(result);
@@ -4329,8 +6009,8 @@ VkShaderModule Pipeline::createShaderModule(const std::vector<char>& code) {
 }
 
 void Pipeline::cleanup() {
-		vkDestroyPipeline(BP->device, graphicsPipeline, nullptr);
-		vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
+		vkDestroyPipeline(BP->device, graphicsPipeline, BP->allocationCallbacks);
+		vkDestroyPipelineLayout(BP->device, pipelineLayout, BP->allocationCallbacks);
 }
 
 void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutBinding> B) {
@@ -4341,8 +6021,16 @@ void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutB
 	std::vector<VkDescriptorSetLayoutBinding> binds;
 	binds.resize(B.size());
 	for(int i = 0; i < B.size(); i++) {
+		// each uniform block has one slot in the ring and one dynamic offset:
+		// arrays of uniform blocks are not supported
+		if((B[i].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) && (B[i].count != 1)) {
+			std::cout << "Uniform binding " << B[i].binding << " has count " << B[i].count << "\n";
+			throw std::runtime_error("uniform buffer bindings must have count 1!");
+		}
 		binds[i].binding = B[i].binding;
-		binds[i].descriptorType = B[i].type;
+		// uniform blocks live in the uniform ring, and are selected with dynamic offsets
+		binds[i].descriptorType = B[i].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER ?
+								  VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC : B[i].type;
 		binds[i].descriptorCount = B[i].count;
 		binds[i].stageFlags = B[i].flags;
 		binds[i].pImmutableSamplers = nullptr;
@@ -4357,7 +6045,7 @@ void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutB
 	layoutInfo.pBindings = binds.data();
 	
 	VkResult result = vkCreateDescriptorSetLayout(BP->device, &layoutInfo,
-								nullptr, &descriptorSetLayout);
+								BP->allocationCallbacks, &descriptorSetLayout);
 	if (result != VK_SUCCESS) {
 		PrintVkError(result);
 		throw std::runtime_error("failed to create descriptor set layout!");
@@ -4365,7 +6053,7 @@ void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutB
 }
 
 void DescriptorSetLayout::cleanup() {
-    	vkDestroyDescriptorSetLayout(BP->device, descriptorSetLayout, nullptr);	
+    	vkDestroyDescriptorSetLayout(BP->device, descriptorSetLayout, BP->allocationCallbacks);	
 }
 
 void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
@@ -4377,126 +6065,1304 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 	int imgInfoSize = DSL->imgInfoSize;
 //std::cout << "imgInfoSize: " << imgInfoSize << "(" << size << ")\n";
 	
-	uniformBuffers.resize(size);
-	uniformBuffersMemory.resize(size);
-	toFree.resize(size);
+	uniformSlots.assign(size, UniformSlot());
+	dynamicOffsetCount = 0;
 
 	for (int j = 0; j < size; j++) {
-		uniformBuffers[j].resize(BP->swapChainImages.size());
-		uniformBuffersMemory[j].resize(BP->swapChainImages.size());
 //std::cout << j << " " << (DSL->Bindings[j].type) << "\n";
 		if(DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
 //std::cout << "Uniform size: " << DSL->Bindings[j].linkSize << "\n";
-			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-				VkDeviceSize bufferSize = DSL->Bindings[j].linkSize;
-				BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-									 	 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-									 	 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-									 	 uniformBuffers[j][i], uniformBuffersMemory[j][i]);
-			}
-			toFree[j] = true;
-		} else {
-			toFree[j] = false;
+			uniformSlots[j] = BP->uniformRing.allocate(DSL->Bindings[j].linkSize);
+			dynamicOffsetCount++;
 		}
 	}
+	if(dynamicOffsetCount > maxDynamicOffsets) {
+		throw std::runtime_error("too many uniform blocks in a descriptor set!");
+	}
 	
-	std::vector<VkDescriptorSetLayout> layouts(BP->swapChainImages.size(),
-											   DSL->descriptorSetLayout);
-	VkDescriptorSetAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	allocInfo.descriptorPool = BP->descriptorPool;
-	allocInfo.descriptorSetCount = static_cast<uint32_t>(BP->swapChainImages.size());
-	allocInfo.pSetLayouts = layouts.data();
 //std::cout << "Allocating\n";	
-	descriptorSets.resize(BP->swapChainImages.size());
-	
-	VkResult result = vkAllocateDescriptorSets(BP->device, &allocInfo,
-										descriptorSets.data());
-	if (result != VK_SUCCESS) {
-		PrintVkError(result);
-		throw std::runtime_error("failed to allocate descriptor sets!");
-	}
+	descriptorSet = BP->descriptorAllocator.allocate(DSL);
 	
-	for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-//std::cout << "Consdering swap chain image " << i << "\n";	
-
-		std::vector<VkWriteDescriptorSet> descriptorWrites(size);
-		std::vector<VkDescriptorBufferInfo> bufferInfo(size);
-		std::vector<VkDescriptorImageInfo> imageInfo(imgInfoSize);
-		for (int j = 0; j < size; j++) {
+	std::vector<VkWriteDescriptorSet> descriptorWrites(size);
+	std::vector<VkDescriptorBufferInfo> bufferInfo(size);
+	std::vector<VkDescriptorImageInfo> imageInfo(imgInfoSize);
+	for (int j = 0; j < size; j++) {
 //std::cout << "Consdering binding " << j << "\n";	
-			if(DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+		if(DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
 //std::cout << "Writing uniform buffer " << j <<"\n";			
-				bufferInfo[j].buffer = uniformBuffers[j][i];
-				bufferInfo[j].offset = 0;
-				bufferInfo[j].range = DSL->Bindings[j].linkSize;
-				
-				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				descriptorWrites[j].dstSet = descriptorSets[i];
-				descriptorWrites[j].dstBinding = DSL->Bindings[j].binding;
-				descriptorWrites[j].dstArrayElement = 0;
-				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-				descriptorWrites[j].descriptorCount = DSL->Bindings[j].count;
-				descriptorWrites[j].pBufferInfo = &bufferInfo[j];
-			} else if(DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER) {
+			// the offset of the region is added by the dynamic offset
+			bufferInfo[j].buffer = uniformSlots[j].page->buffer;
+			bufferInfo[j].offset = uniformSlots[j].offset;
+			bufferInfo[j].range = DSL->Bindings[j].linkSize;
+			
+			descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			descriptorWrites[j].dstSet = descriptorSet;
+			descriptorWrites[j].dstBinding = DSL->Bindings[j].binding;
+			descriptorWrites[j].dstArrayElement = 0;
+			descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+			descriptorWrites[j].descriptorCount = 1;
+			descriptorWrites[j].pBufferInfo = &bufferInfo[j];
+		} else if(DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER) {
 //std::cout << "Writing combined image sampler " << j << ", count " << DSL->Bindings[j].count << ", link " << DSL->Bindings[j].linkSize << "\n";
-				for(int k = 0; k < DSL->Bindings[j].count; k++) {
-					int h = DSL->Bindings[j].linkSize + k;
+			for(int k = 0; k < DSL->Bindings[j].count; k++) {
+				int h = DSL->Bindings[j].linkSize + k;
 //std::cout << k << " " << h << " " << (&VaSs[h]) << "\n";
-					VkDescriptorImageInfo VaS = VaSs[h];
-//std::cout << VaS.imageView << " " << VaS.sampler << "\n";
-					imageInfo[h] = VaS;
-/*					imageInfo[h].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-					imageInfo[h].imageView = VaS.textureImageView;
-					imageInfo[h].sampler = VaS.textureSampler;
-*/				}
-//std::cout << "Writing descriptor sets\n";			
-				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				descriptorWrites[j].dstSet = descriptorSets[i];
-				descriptorWrites[j].dstBinding = DSL->Bindings[j].binding;
-				descriptorWrites[j].dstArrayElement = 0;
-				descriptorWrites[j].descriptorType =
-											VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-				descriptorWrites[j].descriptorCount = DSL->Bindings[j].count;
-				descriptorWrites[j].pImageInfo = &imageInfo[DSL->Bindings[j].linkSize];
+				imageInfo[h] = VaSs[h];
 			}
-		}		
+//std::cout << "Writing descriptor sets\n";			
+			descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			descriptorWrites[j].dstSet = descriptorSet;
+			descriptorWrites[j].dstBinding = DSL->Bindings[j].binding;
+			descriptorWrites[j].dstArrayElement = 0;
+			descriptorWrites[j].descriptorType =
+										VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+			descriptorWrites[j].descriptorCount = DSL->Bindings[j].count;
+			descriptorWrites[j].pImageInfo = &imageInfo[DSL->Bindings[j].linkSize];
+		}
+	}		
 //std::cout << "Updating descriptor sets\n";	
-		vkUpdateDescriptorSets(BP->device,
-						static_cast<uint32_t>(descriptorWrites.size()),
-						descriptorWrites.data(), 0, nullptr);
-	}
+	vkUpdateDescriptorSets(BP->device,
+					static_cast<uint32_t>(descriptorWrites.size()),
+					descriptorWrites.data(), 0, nullptr);
 }
 
 void DescriptorSet::cleanup() {
-	for(int j = 0; j < uniformBuffers.size(); j++) {
-		if(toFree[j]) {
-			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-				vkDestroyBuffer(BP->device, uniformBuffers[j][i], nullptr);
-				vkFreeMemory(BP->device, uniformBuffersMemory[j][i], nullptr);
-			}
-		}
+	for(int j = 0; j < uniformSlots.size(); j++) {
+		BP->uniformRing.free(uniformSlots[j]);
 	}
 }
 
 void DescriptorSet::bind(VkCommandBuffer commandBuffer, Pipeline &P, int setId,
 						 int currentImage) {
-//std::cout << "DS[ci]: " << &descriptorSets[currentImage] << "\n";
+//std::cout << "DS[ci]: " << &descriptorSet << "\n";
+	// all the slots of an image are in the same region of their page
+	uint32_t dynamicOffsets[maxDynamicOffsets];
+	for(int j = 0; j < dynamicOffsetCount; j++) {
+		dynamicOffsets[j] = BP->uniformRing.getDynamicOffset(currentImage);
+	}
 	vkCmdBindDescriptorSets(commandBuffer,
 					VK_PIPELINE_BIND_POINT_GRAPHICS,
-					P.pipelineLayout, setId, 1, &descriptorSets[currentImage],
-					0, nullptr);
+					P.pipelineLayout, setId, 1, &descriptorSet,
+					dynamicOffsetCount, dynamicOffsets);
 }
 
 void DescriptorSet::map(int currentImage, void *src, int slot) {
-	void* data;
-
 	int size = Layout->Bindings[slot].linkSize;
 
-	vkMapMemory(BP->device, uniformBuffersMemory[slot][currentImage], 0,
-						size, 0, &data);
-	memcpy(data, src, size);
-	vkUnmapMemory(BP->device, uniformBuffersMemory[slot][currentImage]);	
+	memcpy(getMapped(currentImage, slot), src, size);
+}
+
+void *DescriptorSet::getMapped(int currentImage, int slot) {
+	return BP->uniformRing.getMapped(uniformSlots[slot], currentImage);
+}
+
+void GPUProfiler::init(BaseProject *bp) {
+	BP = bp;
+	active = false;
+	if(!enabled) {
+		return;
+	}
+	
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &props);
+	timestampPeriod = props.limits.timestampPeriod;
+	
+	QueueFamilyIndices indices = BP->findQueueFamilies(BP->physicalDevice);
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(BP->physicalDevice, &queueFamilyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(BP->physicalDevice, &queueFamilyCount,
+							queueFamilies.data());
+	uint32_t validBits = queueFamilies[indices.graphicsFamily.value()].timestampValidBits;
+	if(validBits == 0) {
+		std::cout << "GPU profiler: timestamps are not supported by the graphics queue\n";
+		return;
+	}
+	timestampMask = (validBits >= 64) ? ~0ull : ((1ull << validBits) - 1);
+	
+	active = true;
+	create();
+}
+
+void GPUProfiler::create() {
+	if(!active) {
+		return;
+	}
+	imageCount = BP->swapChainImages.size();
+	
+	VkQueryPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	poolInfo.queryCount = imageCount * maxScopes * 2;
+	
+	VkResult result = vkCreateQueryPool(BP->device, &poolInfo, BP->allocationCallbacks, &queryPool);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create timestamp query pool!");
+	}
+	
+	// one small command buffer per image, resetting its own region
+	resetCommandBuffers.resize(imageCount);
+	pending.assign(imageCount, false);
+	
+	VkCommandBufferAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.commandPool = BP->commandPool;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandBufferCount = imageCount;
+	
+	result = vkAllocateCommandBuffers(BP->device, &allocInfo, resetCommandBuffers.data());
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate profiler command buffers!");
+	}
+	
+	for(int i = 0; i < imageCount; i++) {
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		if (vkBeginCommandBuffer(resetCommandBuffers[i], &beginInfo) != VK_SUCCESS) {
+			throw std::runtime_error("failed to begin recording command buffer!");
+		}
+		vkCmdResetQueryPool(resetCommandBuffers[i], queryPool, i * maxScopes * 2, maxScopes * 2);
+		if (vkEndCommandBuffer(resetCommandBuffers[i]) != VK_SUCCESS) {
+			throw std::runtime_error("failed to record command buffer!");
+		}
+	}
+}
+
+void GPUProfiler::cleanup() {
+	if(queryPool == VK_NULL_HANDLE) {
+		return;
+	}
+	vkFreeCommandBuffers(BP->device, BP->commandPool, resetCommandBuffers.size(),
+						 resetCommandBuffers.data());
+	resetCommandBuffers.clear();
+	vkDestroyQueryPool(BP->device, queryPool, BP->allocationCallbacks);
+	queryPool = VK_NULL_HANDLE;
+}
+
+int GPUProfiler::registerScope(std::string name) {
+	if(!active) {
+		return -1;
+	}
+	
+	auto found = scopeIds.find(name);
+	if(found != scopeIds.end()) {
+		return found->second;
+	}
+	if(scopes.size() >= maxScopes) {
+		std::cout << "GPU profiler: too many scopes, ignoring " << name << "\n";
+		return -1;
+	}
+	int scope = scopes.size();
+	scopes.push_back({name, 0.0f, 0.0f, 0});
+	scopeIds[name] = scope;
+	return scope;
+}
+
+int GPUProfiler::beginScope(VkCommandBuffer commandBuffer, int currentImage, std::string name) {
+	int scope = registerScope(name);
+	beginScope(commandBuffer, currentImage, scope);
+	return scope;
+}
+
+// Does not touch the scope table: can be called by several threads recording
+// different command buffers, once the scope has been registered
+void GPUProfiler::beginScope(VkCommandBuffer commandBuffer, int currentImage, int scope) {
+	if(!active || (scope < 0)) {
+		return;
+	}
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool,
+						(currentImage * maxScopes + scope) * 2);
+}
+
+void GPUProfiler::endScope(VkCommandBuffer commandBuffer, int currentImage, int scope) {
+	if(!active || (scope < 0)) {
+		return;
+	}
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool,
+						(currentImage * maxScopes + scope) * 2 + 1);
+}
+
+void GPUProfiler::markSubmitted(int currentImage) {
+	if(active) {
+		pending[currentImage] = true;
+	}
+}
+
+void GPUProfiler::collect(int currentImage) {
+	if(!active || !pending[currentImage] || scopes.empty()) {
+		return;
+	}
+	pending[currentImage] = false;
+	
+	// value and availability for each of the begin and end queries
+	int n = scopes.size();
+	std::vector<uint64_t> data(n * 4);
+	VkResult result = vkGetQueryPoolResults(BP->device, queryPool,
+						currentImage * maxScopes * 2, n * 2,
+						data.size() * sizeof(uint64_t), data.data(),
+						2 * sizeof(uint64_t),
+						VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+	if((result != VK_SUCCESS) && (result != VK_NOT_READY)) {
+		PrintVkError(result);
+		return;
+	}
+	
+	for(int k = 0; k < n; k++) {
+		uint64_t tBegin = data[k * 4], tEnd = data[k * 4 + 2];
+		// scopes not recorded in the command buffers of this image are not available
+		if((data[k * 4 + 1] == 0) || (data[k * 4 + 3] == 0)) {
+			continue;
+		}
+		if(!hasFirstTimestamp) {
+			firstTimestamp = tBegin;
+			hasFirstTimestamp = true;
+		}
+		double durNs = (double)((tEnd - tBegin) & timestampMask) * timestampPeriod;
+		double startNs = (double)((tBegin - firstTimestamp) & timestampMask) * timestampPeriod;
+		
+		scopes[k].lastMs = (float)(durNs / 1000000.0);
+		scopes[k].totalMs += scopes[k].lastMs;
+		scopes[k].samples++;
+		
+		if(events.size() < maxEvents) {
+			events.push_back({k, frame, startNs / 1000.0, durNs / 1000.0});
+		}
+	}
+	frame++;
+}
+
+float GPUProfiler::getScopeMs(std::string name) {
+	auto found = scopeIds.find(name);
+	return (found != scopeIds.end()) ? scopes[found->second].lastMs : 0.0f;
+}
+
+float GPUProfiler::getScopeAverageMs(std::string name) {
+	auto found = scopeIds.find(name);
+	if((found == scopeIds.end()) || (scopes[found->second].samples == 0)) {
+		return 0.0f;
+	}
+	return scopes[found->second].totalMs / scopes[found->second].samples;
+}
+
+void GPUProfiler::printReport() {
+	std::cout << "GPU profile (" << frame << " frames):\n";
+	for(auto &S : scopes) {
+		std::cout << "  " << S.name << ": last " << S.lastMs << " ms, average "
+				  << (S.samples > 0 ? S.totalMs / S.samples : 0.0f) << " ms\n";
+	}
+}
+
+void GPUProfiler::dumpChromeTrace(std::string file) {
+	std::ofstream out(file);
+	if (!out.is_open()) {
+		std::cout << "Failed to open: " << file << "\n";
+		return;
+	}
+	
+	// Trace Event Format, loadable in chrome://tracing or Perfetto
+	out << "{\"traceEvents\":[\n";
+	for(int i = 0; i < events.size(); i++) {
+		GPUProfilerEvent &E = events[i];
+		// scope names come from technique ids: quotes and backslashes are escaped
+		out << "{\"name\":" << nlohmann::json(scopes[E.scope].name).dump(-1, ' ', false,
+												nlohmann::json::error_handler_t::replace)
+			<< ",\"cat\":\"gpu\",\"ph\":\"X\""
+			<< ",\"ts\":" << E.startUs << ",\"dur\":" << E.durUs
+			<< ",\"pid\":0,\"tid\":0,\"args\":{\"frame\":" << E.frame << "}}"
+			<< ((i < events.size() - 1) ? ",\n" : "\n");
+	}
+	out << "]}\n";
+	out.close();
+	std::cout << "GPU trace with " << events.size() << " events written to: " << file << "\n";
+}
+
+const char *FrameTimer::phaseNames[FTP_COUNT] = {
+	"CPU wait", "Acquire", "Uniforms", "Cmd buffers", "Submit", "Present", "GPU idle", "Frame"
+};
+
+FrameTimer::FrameTimer() {
+	for(int p = 0; p < FTP_COUNT; p++) {
+		for(int b = 0; b < numBins; b++) {
+			hist[p][b].store(0, std::memory_order_relaxed);
+		}
+	}
+	memset(&cur, 0, sizeof(cur));
+}
+
+int FrameTimer::binOf(float ms) {
+	float us = ms * 1000.0f;
+	if(us <= 1.0f) {
+		return 0;
+	}
+	int b = (int)(std::log2(us) * binsPerOctave);
+	return (b < numBins) ? b : numBins - 1;
+}
+
+void FrameTimer::beginFrame() {
+	memset(&cur, 0, sizeof(cur));
+	frameStart = std::chrono::high_resolution_clock::now();
+	phaseStart = frameStart;
+}
+
+void FrameTimer::stop(FrameTimerPhase phase) {
+	auto now = std::chrono::high_resolution_clock::now();
+	// phases can be entered more than once per frame (e.g. the two fences)
+	cur.ms[phase] += std::chrono::duration<float, std::chrono::milliseconds::period>
+				(now - phaseStart).count();
+	phaseStart = now;
+}
+
+// for values not measured by stop()
+void FrameTimer::set(FrameTimerPhase phase, float ms) {
+	cur.ms[phase] = ms;
 }
 
-#endif
\ No newline at end of file
+void FrameTimer::endFrame() {
+	cur.ms[FTP_TOTAL] = std::chrono::duration<float, std::chrono::milliseconds::period>
+				(std::chrono::high_resolution_clock::now() - frameStart).count();
+	
+	uint32_t n = written.load(std::memory_order_relaxed);
+	FrameTimerSample &S = ring[n % ringSize];
+	for(int p = 0; p < FTP_COUNT; p++) {
+		// the oldest frame leaves the rolling window
+		if(n >= ringSize) {
+			hist[p][binOf(S.ms[p])].fetch_sub(1, std::memory_order_relaxed);
+		}
+		hist[p][binOf(cur.ms[p])].fetch_add(1, std::memory_order_relaxed);
+	}
+	S = cur;
+	written.store(n + 1, std::memory_order_release);
+}
+
+float FrameTimer::getLastMs(FrameTimerPhase phase) {
+	uint32_t n = written.load(std::memory_order_acquire);
+	return (n > 0) ? ring[(n - 1) % ringSize].ms[phase] : 0.0f;
+}
+
+float FrameTimer::getPercentileMs(FrameTimerPhase phase, float q) {
+	uint32_t total = 0;
+	uint32_t counts[numBins];
+	for(int b = 0; b < numBins; b++) {
+		counts[b] = hist[phase][b].load(std::memory_order_relaxed);
+		total += counts[b];
+	}
+	if(total == 0) {
+		return 0.0f;
+	}
+	
+	uint32_t target = (uint32_t)std::ceil(q * total);
+	uint32_t acc = 0;
+	int b;
+	for(b = 0; b < numBins - 1; b++) {
+		acc += counts[b];
+		if(acc >= target) {
+			break;
+		}
+	}
+	// upper edge of the bin, in ms
+	return std::exp2((float)(b + 1) / binsPerOctave) / 1000.0f;
+}
+
+std::string FrameTimer::getReport() {
+	std::ostringstream oss;
+	oss << std::fixed << std::setprecision(2);
+	oss << "CPU ms: last / p50 / p99\n";
+	for(int p = 0; p < FTP_COUNT; p++) {
+		FrameTimerPhase P = (FrameTimerPhase)p;
+		oss << phaseNames[p] << ": " << getLastMs(P) << " / "
+			<< getPercentileMs(P, 0.5f) << " / " << getPercentileMs(P, 0.99f) << "\n";
+	}
+	return oss.str();
+}
+
+void GPUMemoryAllocator::init(BaseProject *bp) {
+	BP = bp;
+	device = bp->device;
+	vkGetPhysicalDeviceMemoryProperties(bp->physicalDevice, &memProperties);
+	
+	// small heaps, like the host visible part of device local memory,
+	// get smaller blocks so that a few of them can coexist
+	for(uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+		VkDeviceSize heapSize =
+			memProperties.memoryHeaps[memProperties.memoryTypes[i].heapIndex].size;
+		blockSize[i] = heapSize / 8 < defaultBlockSize ? heapSize / 8 : defaultBlockSize;
+	}
+	
+	// true UMA: every device local heap can be mapped. A discrete GPU with
+	// resizable BAR also has a mappable device local type, but its video
+	// memory heap still has types that are not host visible, and its
+	// system memory heap is not device local
+	const VkMemoryPropertyFlags UMA = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+									  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+									  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	bool allMappable = true;
+	bool hasHostHeap = false;
+	for(uint32_t h = 0; h < memProperties.memoryHeapCount; h++) {
+		if(!(memProperties.memoryHeaps[h].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)) {
+			hasHostHeap = true;
+			continue;
+		}
+		for(uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+			VkMemoryPropertyFlags flags = memProperties.memoryTypes[i].propertyFlags;
+			if((memProperties.memoryTypes[i].heapIndex == h) && ((flags & UMA) != UMA) &&
+			   !(flags & (VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT | VK_MEMORY_PROPERTY_PROTECTED_BIT))) {
+				allMappable = false;
+			}
+		}
+	}
+	unifiedMemory = allMappable && !hasHostHeap;
+	std::cout << "Unified memory: " << (unifiedMemory ? "yes" : "no") << "\n";
+	
+	hasMemoryBudget = bp->memoryBudgetEnabled;
+	for(int t = 0; t < GMT_COUNT; t++) {
+		for(int l = 0; l < GML_COUNT; l++) {
+			taggedBytes[t][l] = 0;
+			taggedCount[t][l] = 0;
+		}
+	}
+	peakBytesUsed = 0;
+	lastRecreationBytes = 0;
+	recreations = 0;
+}
+
+void GPUMemoryAllocator::cleanup() {
+	// leak check: everything should have been freed by now
+	for(int t = 0; t < GMT_COUNT; t++) {
+		for(int l = 0; l < GML_COUNT; l++) {
+			if(taggedCount[t][l] > 0) {
+				std::cout << "GPU memory leak: " << taggedCount[t][l] << " " << tagNames[t]
+						  << " allocations (" << lifetimeNames[l] << "), "
+						  << taggedBytes[t][l] << " bytes\n";
+			}
+		}
+	}
+	
+	for(int p = 0; p < 2 * VK_MAX_MEMORY_TYPES; p++) {
+		for(GPUMemoryBlock *block : pools[p]) {
+			destroyBlock(block);
+		}
+		pools[p].clear();
+	}
+	for(GPUMemoryBlock *block : dedicated) {
+		destroyBlock(block);
+	}
+	dedicated.clear();
+}
+
+const char *GPUMemoryAllocator::tagNames[GMT_COUNT] = {
+	"other", "mesh", "texture", "uniform", "attachment", "staging"};
+const char *GPUMemoryAllocator::lifetimeNames[GML_COUNT] = {
+	"static", "swap chain", "transient"};
+
+VkDeviceSize GPUMemoryAllocator::getTaggedBytes(GPUMemoryTag tag) {
+	std::lock_guard<std::mutex> guard(lock);
+	VkDeviceSize bytes = 0;
+	for(int l = 0; l < GML_COUNT; l++) {
+		bytes += taggedBytes[tag][l];
+	}
+	return bytes;
+}
+
+// Usage and budget of each heap, as seen by the driver (including other
+// processes and memory not allocated through this allocator)
+bool GPUMemoryAllocator::getBudget(std::vector<VkDeviceSize> &heapUsage,
+								   std::vector<VkDeviceSize> &heapBudget) {
+	if(!hasMemoryBudget) {
+		return false;
+	}
+	VkPhysicalDeviceMemoryBudgetPropertiesEXT budget{};
+	budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+	VkPhysicalDeviceMemoryProperties2 props2{};
+	props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+	props2.pNext = &budget;
+	vkGetPhysicalDeviceMemoryProperties2(BP->physicalDevice, &props2);
+	
+	heapUsage.resize(props2.memoryProperties.memoryHeapCount);
+	heapBudget.resize(props2.memoryProperties.memoryHeapCount);
+	for(uint32_t h = 0; h < props2.memoryProperties.memoryHeapCount; h++) {
+		heapUsage[h] = budget.heapUsage[h];
+		heapBudget[h] = budget.heapBudget[h];
+	}
+	return true;
+}
+
+void GPUMemoryAllocator::printReport() {
+	printStats();
+	// formatted apart, so that the state of std::cout is not changed
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(2);
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for(int t = 0; t < GMT_COUNT; t++) {
+			for(int l = 0; l < GML_COUNT; l++) {
+				if(taggedCount[t][l] > 0) {
+					out << "  " << tagNames[t] << " (" << lifetimeNames[l] << "): "
+						<< taggedCount[t][l] << " allocations, "
+						<< taggedBytes[t][l] / 1048576.0 << " MB\n";
+				}
+			}
+		}
+		out << "  peak: " << peakBytesUsed / 1048576.0 << " MB\n";
+	}
+	
+	std::vector<VkDeviceSize> heapUsage, heapBudget;
+	if(getBudget(heapUsage, heapBudget)) {
+		for(int h = 0; h < heapUsage.size(); h++) {
+			out << "  heap " << h
+				<< ((memProperties.memoryHeaps[h].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ?
+					" (device local)" : "")
+				<< ": " << heapUsage[h] / 1048576.0 << " / "
+				<< heapBudget[h] / 1048576.0 << " MB\n";
+		}
+	} else {
+		out << "  (VK_EXT_memory_budget not available)\n";
+	}
+	std::cout << out.str();
+}
+
+// Resources that depend on the swap chain are rebuilt with the same size,
+// so the memory in use should not change across recreations.
+// Called after each swap chain (re)creation
+void GPUMemoryAllocator::trackSwapChainMemory() {
+	GPUMemoryStats S = getStats();
+	// the first call records the usage after the initial creation
+	if((recreations > 0) && (S.bytesUsed > lastRecreationBytes)) {
+		std::cout << "GPU memory grew by " << (S.bytesUsed - lastRecreationBytes)
+				  << " bytes across swap chain recreation " << recreations << "\n";
+	}
+	recreations++;
+	lastRecreationBytes = S.bytesUsed;
+}
+
+GPUMemoryBlock *GPUMemoryAllocator::createBlock(uint32_t memoryType, VkDeviceSize size) {
+	VkMemoryAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = size;
+	allocInfo.memoryTypeIndex = memoryType;
+
+	GPUMemoryBlock *block = new GPUMemoryBlock();
+	VkResult result = vkAllocateMemory(device, &allocInfo, BP->allocationCallbacks, &block->memory);
+	if (result != VK_SUCCESS) {
+		delete block;
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate device memory block!");
+	}
+	block->memoryType = memoryType;
+	block->size = size;
+	block->freeList.push_back({0, size});
+	
+	if(memProperties.memoryTypes[memoryType].propertyFlags &
+							VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		result = vkMapMemory(device, block->memory, 0, VK_WHOLE_SIZE, 0, &block->mapped);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to map device memory block!");
+		}
+	}
+//std::cout << "New memory block: type " << memoryType << ", " << size << " bytes\n";
+	return block;
+}
+
+void GPUMemoryAllocator::destroyBlock(GPUMemoryBlock *block) {
+	if(block->mapped != nullptr) {
+		vkUnmapMemory(device, block->memory);
+	}
+	vkFreeMemory(device, block->memory, BP->allocationCallbacks);
+	delete block;
+}
+
+// First fit. The alignment padding in front of the range stays in
+// the free list, so releasing it gives back exactly size bytes.
+bool allocateRange(std::vector<GPUMemoryRange> &FL, VkDeviceSize size,
+				   VkDeviceSize alignment, VkDeviceSize &offset) {
+	for(size_t i = 0; i < FL.size(); i++) {
+		GPUMemoryRange R = FL[i];
+		VkDeviceSize aligned = (R.offset + alignment - 1) / alignment * alignment;
+		if(aligned + size > R.offset + R.size) {
+			continue;
+		}
+		VkDeviceSize tail = R.offset + R.size - (aligned + size);
+		if(aligned > R.offset) {
+			FL[i].size = aligned - R.offset;
+			if(tail > 0) {
+				FL.insert(FL.begin() + i + 1, {aligned + size, tail});
+			}
+		} else if(tail > 0) {
+			FL[i] = {aligned + size, tail};
+		} else {
+			FL.erase(FL.begin() + i);
+		}
+		offset = aligned;
+		return true;
+	}
+	return false;
+}
+
+void releaseRange(std::vector<GPUMemoryRange> &FL, VkDeviceSize offset,
+				  VkDeviceSize size) {
+	// insert the range keeping the list sorted, then merge it with its neighbours
+	auto it = std::lower_bound(FL.begin(), FL.end(), offset,
+				[](const GPUMemoryRange &R, VkDeviceSize o) {return R.offset < o;});
+	size_t i = it - FL.begin();
+	FL.insert(it, {offset, size});
+	if((i + 1 < FL.size()) && (FL[i].offset + FL[i].size == FL[i+1].offset)) {
+		FL[i].size += FL[i+1].size;
+		FL.erase(FL.begin() + i + 1);
+	}
+	if((i > 0) && (FL[i-1].offset + FL[i-1].size == FL[i].offset)) {
+		FL[i-1].size += FL[i].size;
+		FL.erase(FL.begin() + i);
+	}
+}
+
+bool GPUMemoryAllocator::allocateFromBlock(GPUMemoryBlock *block, VkDeviceSize size,
+						   VkDeviceSize alignment, VkDeviceSize &offset) {
+	if(block->size - block->used < size) {
+		return false;
+	}
+	if(!allocateRange(block->freeList, size, alignment, offset)) {
+		return false;
+	}
+	block->used += size;
+	block->allocations++;
+	return true;
+}
+
+GPUAllocation GPUMemoryAllocator::allocate(const VkMemoryRequirements &memRequirements,
+						   VkMemoryPropertyFlags properties, bool optimalImage,
+						   GPUMemoryTag tag, GPUMemoryLifetime lifetime) {
+	uint32_t memoryType = BP->findMemoryType(memRequirements.memoryTypeBits, properties);
+	std::lock_guard<std::mutex> guard(lock);
+	
+	GPUAllocation alloc;
+	alloc.size = memRequirements.size;
+	alloc.tag = tag;
+	alloc.lifetime = lifetime;
+	taggedBytes[tag][lifetime] += alloc.size;
+	taggedCount[tag][lifetime]++;
+	VkDeviceSize totalBytes = 0;
+	for(int t = 0; t < GMT_COUNT; t++) {
+		for(int l = 0; l < GML_COUNT; l++) {
+			totalBytes += taggedBytes[t][l];
+		}
+	}
+	peakBytesUsed = std::max(peakBytesUsed, totalBytes);
+
+	// resources larger than half a block get their own memory
+	if(memRequirements.size > blockSize[memoryType] / 2) {
+		GPUMemoryBlock *block = createBlock(memoryType, memRequirements.size);
+		block->freeList.clear();
+		block->used = block->size;
+		block->allocations = 1;
+		dedicated.push_back(block);
+		
+		alloc.memory = block->memory;
+		alloc.offset = 0;
+		alloc.mapped = block->mapped;
+		alloc.block = block;
+		alloc.pool = -1;
+		return alloc;
+	}
+	
+	int pool = 2 * memoryType + (optimalImage ? 1 : 0);
+	GPUMemoryBlock *block = nullptr;
+	VkDeviceSize offset = 0;
+	for(GPUMemoryBlock *B : pools[pool]) {
+		if(allocateFromBlock(B, memRequirements.size, memRequirements.alignment, offset)) {
+			block = B;
+			break;
+		}
+	}
+	if(block == nullptr) {
+		block = createBlock(memoryType, blockSize[memoryType]);
+		pools[pool].push_back(block);
+		if(!allocateFromBlock(block, memRequirements.size, memRequirements.alignment, offset)) {
+			throw std::runtime_error("failed to sub-allocate device memory!");
+		}
+	}
+	
+	alloc.memory = block->memory;
+	alloc.offset = offset;
+	alloc.mapped = block->mapped != nullptr ?
+				   static_cast<char *>(block->mapped) + offset : nullptr;
+	alloc.block = block;
+	alloc.pool = pool;
+	return alloc;
+}
+
+void GPUMemoryAllocator::free(GPUAllocation &alloc) {
+	if(alloc.block == nullptr) {
+		return;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	GPUMemoryBlock *block = alloc.block;
+	taggedBytes[alloc.tag][alloc.lifetime] -= alloc.size;
+	taggedCount[alloc.tag][alloc.lifetime]--;
+	
+	if(alloc.pool < 0) {
+		dedicated.erase(std::find(dedicated.begin(), dedicated.end(), block));
+		destroyBlock(block);
+		alloc = GPUAllocation();
+		return;
+	}
+	
+	releaseRange(block->freeList, alloc.offset, alloc.size);
+	block->used -= alloc.size;
+	block->allocations--;
+	
+	// empty blocks are released, but every pool keeps one so that
+	// recreating the swap chain resources does not allocate again
+	std::vector<GPUMemoryBlock *> &P = pools[alloc.pool];
+	if((block->allocations == 0) && (P.size() > 1)) {
+		P.erase(std::find(P.begin(), P.end(), block));
+		destroyBlock(block);
+	}
+	alloc = GPUAllocation();
+}
+
+GPUMemoryStats GPUMemoryAllocator::getStats() {
+	std::lock_guard<std::mutex> guard(lock);
+	GPUMemoryStats S{};
+	VkDeviceSize totalFree = 0;
+	VkDeviceSize contiguousFree = 0;
+	
+	auto addBlock = [&](GPUMemoryBlock *block) {
+		S.blocks++;
+		S.allocations += block->allocations;
+		S.bytesAllocated += block->size;
+		S.bytesUsed += block->used;
+		VkDeviceSize largest = 0;
+		for(const GPUMemoryRange &R : block->freeList) {
+			totalFree += R.size;
+			largest = std::max(largest, R.size);
+		}
+		contiguousFree += largest;
+		S.largestFreeRange = std::max(S.largestFreeRange, largest);
+	};
+	for(int p = 0; p < 2 * VK_MAX_MEMORY_TYPES; p++) {
+		for(GPUMemoryBlock *block : pools[p]) {
+			addBlock(block);
+		}
+	}
+	for(GPUMemoryBlock *block : dedicated) {
+		addBlock(block);
+	}
+	
+	// fraction of the free memory that is not part of the largest range of its block
+	S.fragmentation = totalFree > 0 ?
+			(float)(totalFree - contiguousFree) / (float)totalFree : 0.0f;
+	return S;
+}
+
+void GPUMemoryAllocator::printStats() {
+	GPUMemoryStats S = getStats();
+	// formatted apart, so that the state of std::cout is not changed
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(2);
+	out << "GPU memory: " << S.allocations << " allocations in "
+		<< S.blocks << " blocks (" << dedicated.size() << " dedicated), "
+		<< S.bytesUsed / 1048576.0 << " / " << S.bytesAllocated / 1048576.0
+		<< " MB used, fragmentation " << S.fragmentation * 100.0f << "%\n";
+	std::cout << out.str();
+}
+
+void StagingUploader::init(BaseProject *bp) {
+	BP = bp;
+	head = 0;
+	batchDepth = 0;
+	submissions = 0;
+	if(BP->memoryAllocator.unifiedMemory) {
+		// nothing will ever be staged
+		return;
+	}
+	BP->createBuffer(capacity, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+					 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 stagingBuffer, stagingMemory, GMT_STAGING);
+}
+
+void StagingUploader::cleanup() {
+	flush();
+	if(stagingBuffer != VK_NULL_HANDLE) {
+		vkDestroyBuffer(BP->device, stagingBuffer, BP->allocationCallbacks);
+		BP->memoryAllocator.free(stagingMemory);
+		stagingBuffer = VK_NULL_HANDLE;
+	}
+}
+
+void StagingUploader::beginBatch() {
+	batchDepth++;
+}
+
+void StagingUploader::endBatch() {
+	batchDepth--;
+	if(batchDepth == 0) {
+		flush();
+	}
+}
+
+void StagingUploader::uploadBuffer(VkBuffer dst, const void *src, VkDeviceSize size,
+					  VkDeviceSize dstOffset) {
+	const char *data = static_cast<const char *>(src);
+	while(size > 0) {
+		if(head >= capacity) {
+			flush();
+		}
+		if(commandBuffer == VK_NULL_HANDLE) {
+			commandBuffer = BP->beginSingleTimeCommands();
+		}
+		VkDeviceSize chunk = std::min(size, capacity - head);
+		memcpy(static_cast<char *>(stagingMemory.mapped) + head, data, (size_t)chunk);
+		
+		VkBufferCopy region{};
+		region.srcOffset = head;
+		region.dstOffset = dstOffset;
+		region.size = chunk;
+		vkCmdCopyBuffer(commandBuffer, stagingBuffer, dst, 1, &region);
+
+		// keeps the next copy 16 bytes aligned
+		head = (head + chunk + 15) & ~(VkDeviceSize)15;
+		data += chunk;
+		dstOffset += chunk;
+		size -= chunk;
+	}
+	
+	if(batchDepth == 0) {
+		flush();
+	}
+}
+
+void StagingUploader::flush() {
+	if(commandBuffer == VK_NULL_HANDLE) {
+		return;
+	}
+	// makes the copies visible to the vertex input stage
+	VkMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+							VK_ACCESS_INDEX_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+						 VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+						 1, &barrier, 0, nullptr, 0, nullptr);
+
+	// waits for the queue to be idle, so the staging buffer can be reused
+	BP->endSingleTimeCommands(commandBuffer);
+	commandBuffer = VK_NULL_HANDLE;
+	head = 0;
+	submissions++;
+//std::cout << "Staging upload " << submissions << "\n";
+}
+
+void UniformRing::init(BaseProject *bp, int nImages) {
+	BP = bp;
+	imageCount = nImages;
+	
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &props);
+	alignment = std::max(props.limits.minUniformBufferOffsetAlignment, (VkDeviceSize)16);
+	// dynamic offsets must be aligned too
+	regionStride = (regionSize + alignment - 1) / alignment * alignment;
+}
+
+void UniformRing::cleanup() {
+	for(UniformRingPage *page : pages) {
+		if(page->slots > 0) {
+			std::cout << "Uniform ring: " << page->slots << " slots were not freed\n";
+		}
+		vkDestroyBuffer(BP->device, page->buffer, BP->allocationCallbacks);
+		BP->memoryAllocator.free(page->memory);
+		delete page;
+	}
+	pages.clear();
+}
+
+// The regions depend on the number of images: the pages are rebuilt when
+// it changes, which happens only while all the descriptor sets are destroyed
+void UniformRing::setImageCount(int nImages) {
+	if(nImages == imageCount) {
+		return;
+	}
+	cleanup();
+	imageCount = nImages;
+}
+
+UniformSlot UniformRing::allocate(VkDeviceSize size) {
+	if(size > regionSize) {
+		throw std::runtime_error("uniform block larger than the uniform ring region!");
+	}
+	UniformSlot slot;
+	slot.size = size;
+	for(UniformRingPage *page : pages) {
+		if(allocateRange(page->freeList, size, alignment, slot.offset)) {
+			slot.page = page;
+			break;
+		}
+	}
+	if(slot.page == nullptr) {
+		UniformRingPage *page = new UniformRingPage();
+		BP->createBuffer(regionStride * imageCount, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+						 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+						 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+						 page->buffer, page->memory, GMT_UNIFORM);
+		if(page->memory.mapped == nullptr) {
+			throw std::runtime_error("failed to map uniform buffer!");
+		}
+		page->freeList.push_back({0, regionSize});
+		pages.push_back(page);
+		allocateRange(page->freeList, size, alignment, slot.offset);
+		slot.page = page;
+	}
+	slot.page->slots++;
+	return slot;
+}
+
+void UniformRing::free(UniformSlot &slot) {
+	if(slot.page == nullptr) {
+		return;
+	}
+	releaseRange(slot.page->freeList, slot.offset, slot.size);
+	slot.page->slots--;
+	slot = UniformSlot();
+}
+
+void DescriptorAllocator::init(BaseProject *bp) {
+	BP = bp;
+	currentPool = VK_NULL_HANDLE;
+	sets = 0;
+	uniformDescriptors = 0;
+	samplerDescriptors = 0;
+	peakSets = 0;
+	poolCount = 0;
+}
+
+void DescriptorAllocator::cleanup() {
+	if(currentPool != VK_NULL_HANDLE) {
+		vkDestroyDescriptorPool(BP->device, currentPool, BP->allocationCallbacks);
+		currentPool = VK_NULL_HANDLE;
+	}
+	for(VkDescriptorPool pool : fullPools) {
+		vkDestroyDescriptorPool(BP->device, pool, BP->allocationCallbacks);
+	}
+	for(VkDescriptorPool pool : freePools) {
+		vkDestroyDescriptorPool(BP->device, pool, BP->allocationCallbacks);
+	}
+	fullPools.clear();
+	freePools.clear();
+	poolCount = 0;
+}
+
+VkDescriptorPool DescriptorAllocator::nextPool() {
+	if(!freePools.empty()) {
+		VkDescriptorPool pool = freePools.back();
+		freePools.pop_back();
+		return pool;
+	}
+	
+	std::array<VkDescriptorPoolSize, 2> poolSizes{};
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	poolSizes[0].descriptorCount = uniformsPerSet * setsPerPool;
+	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSizes[1].descriptorCount = samplersPerSet * setsPerPool;
+														 
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+	poolInfo.pPoolSizes = poolSizes.data();
+	poolInfo.maxSets = setsPerPool;
+	
+	VkDescriptorPool pool;
+	VkResult result = vkCreateDescriptorPool(BP->device, &poolInfo, BP->allocationCallbacks, &pool);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create descriptor pool!");
+	}
+	poolCount++;
+//std::cout << "New descriptor pool: " << poolCount << "\n";
+	return pool;
+}
+
+VkDescriptorSet DescriptorAllocator::allocate(DescriptorSetLayout *DSL) {
+	if(currentPool == VK_NULL_HANDLE) {
+		currentPool = nextPool();
+	}
+	
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = currentPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &DSL->descriptorSetLayout;
+	
+	VkDescriptorSet set;
+	VkResult result = vkAllocateDescriptorSets(BP->device, &allocInfo, &set);
+	if ((result == VK_ERROR_OUT_OF_POOL_MEMORY_KHR) ||
+		(result == VK_ERROR_FRAGMENTED_POOL)) {
+		// the current pool is full: continue with a new one
+		fullPools.push_back(currentPool);
+		currentPool = nextPool();
+		allocInfo.descriptorPool = currentPool;
+		result = vkAllocateDescriptorSets(BP->device, &allocInfo, &set);
+	}
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate descriptor sets!");
+	}
+	
+	sets++;
+	peakSets = std::max(peakSets, sets);
+	for(const DescriptorSetLayoutBinding &B : DSL->Bindings) {
+		if(B.type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+			uniformDescriptors += B.count;
+		} else {
+			samplerDescriptors += B.count;
+		}
+	}
+	return set;
+}
+
+void DescriptorAllocator::reset() {
+	if(sets == 0) {
+		return;
+	}
+	if(currentPool != VK_NULL_HANDLE) {
+		vkResetDescriptorPool(BP->device, currentPool, 0);
+		freePools.push_back(currentPool);
+		currentPool = VK_NULL_HANDLE;
+	}
+	for(VkDescriptorPool pool : fullPools) {
+		vkResetDescriptorPool(BP->device, pool, 0);
+		freePools.push_back(pool);
+	}
+	fullPools.clear();
+	sets = 0;
+	uniformDescriptors = 0;
+	samplerDescriptors = 0;
+}
+
+void DescriptorAllocator::printStats(std::string name) {
+	std::cout << name << ": " << sets << " sets (peak " << peakSets << "), "
+			  << uniformDescriptors << " uniform blocks, " << samplerDescriptors
+			  << " textures, " << poolCount << " pools of " << setsPerPool << " sets\n";
+}
+
+uint64_t HostAllocationCounters::totalAllocations() const {
+	uint64_t total = 0;
+	for(int i = 0; i < scopeCount; i++) {
+		total += allocations[i] + internalAllocations[i];
+	}
+	return total;
+}
+
+uint64_t HostAllocationCounters::totalBytes() const {
+	uint64_t total = 0;
+	for(int i = 0; i < scopeCount; i++) {
+		total += bytes[i] + internalBytes[i];
+	}
+	return total;
+}
+
+// Every block starts with a header, placed just before the aligned
+// pointer returned to the driver
+struct HostAllocationHeader {
+	void *base;
+	size_t size;
+	int scope;
+	// -1 for blocks too large for the free lists
+	int sizeClass;
+};
+
+const char *HostAllocator::scopeNames[HostAllocationCounters::scopeCount] = {
+	"command", "object", "cache", "device", "instance"};
+
+const VkAllocationCallbacks *HostAllocator::init() {
+	callbacks.pUserData = this;
+	callbacks.pfnAllocation = allocationFunction;
+	callbacks.pfnReallocation = reallocationFunction;
+	callbacks.pfnFree = freeFunction;
+	callbacks.pfnInternalAllocation = internalAllocationNotification;
+	callbacks.pfnInternalFree = internalFreeNotification;
+	return &callbacks;
+}
+
+// Must be called after the instance has been destroyed
+void HostAllocator::cleanup() {
+	std::lock_guard<std::mutex> guard(lock);
+	for(int c = 0; c < sizeClasses; c++) {
+		for(void *block : freeBlocks[c]) {
+			std::free(block);
+		}
+		freeBlocks[c].clear();
+	}
+	for(int i = 0; i < HostAllocationCounters::scopeCount; i++) {
+		if(liveAllocations[i] > 0) {
+			std::cout << "Host allocator: " << liveAllocations[i] << " " << scopeNames[i]
+					  << " allocations (" << liveBytes[i] << " bytes) were not freed\n";
+		}
+	}
+}
+
+void *HostAllocator::allocate(size_t size, size_t alignment, VkSystemAllocationScope scope) {
+	if(size == 0) {
+		return nullptr;
+	}
+	int sc = (int)scope;
+	size_t blockSize = sizeof(HostAllocationHeader) + alignment - 1 + size;
+	
+	std::lock_guard<std::mutex> guard(lock);
+	int sizeClass = -1;
+	size_t classSize = minClassSize;
+	for(int c = 0; c < sizeClasses; c++, classSize *= 2) {
+		if(blockSize <= classSize) {
+			sizeClass = c;
+			break;
+		}
+	}
+	
+	void *base;
+	if((sizeClass >= 0) && (freeBlocks[sizeClass].size() > 0)) {
+		base = freeBlocks[sizeClass].back();
+		freeBlocks[sizeClass].pop_back();
+		pooledAllocations++;
+	} else {
+		base = std::malloc(sizeClass >= 0 ? classSize : blockSize);
+		if(base == nullptr) {
+			return nullptr;
+		}
+	}
+	
+	uintptr_t first = reinterpret_cast<uintptr_t>(base) + sizeof(HostAllocationHeader);
+	uintptr_t aligned = (first + alignment - 1) & ~(uintptr_t)(alignment - 1);
+	HostAllocationHeader header = {base, size, sc, sizeClass};
+	std::memcpy(reinterpret_cast<void *>(aligned - sizeof(HostAllocationHeader)),
+				&header, sizeof(HostAllocationHeader));
+	
+	counters.allocations[sc]++;
+	counters.bytes[sc] += size;
+	liveAllocations[sc]++;
+	liveBytes[sc] += size;
+	int64_t total = 0;
+	for(int i = 0; i < HostAllocationCounters::scopeCount; i++) {
+		total += liveBytes[i];
+	}
+	peakBytes = std::max(peakBytes, total);
+	return reinterpret_cast<void *>(aligned);
+}
+
+void HostAllocator::release(void *memory) {
+	if(memory == nullptr) {
+		return;
+	}
+	HostAllocationHeader header;
+	std::memcpy(&header, static_cast<char *>(memory) - sizeof(HostAllocationHeader),
+				sizeof(HostAllocationHeader));
+	
+	std::lock_guard<std::mutex> guard(lock);
+	liveAllocations[header.scope]--;
+	liveBytes[header.scope] -= header.size;
+	if(header.sizeClass >= 0) {
+		freeBlocks[header.sizeClass].push_back(header.base);
+	} else {
+		std::free(header.base);
+	}
+}
+
+void *HostAllocator::reallocate(void *original, size_t size, size_t alignment,
+								VkSystemAllocationScope scope) {
+	if(original == nullptr) {
+		return allocate(size, alignment, scope);
+	}
+	if(size == 0) {
+		release(original);
+		return nullptr;
+	}
+	HostAllocationHeader header;
+	std::memcpy(&header, static_cast<char *>(original) - sizeof(HostAllocationHeader),
+				sizeof(HostAllocationHeader));
+	void *memory = allocate(size, alignment, scope);
+	if(memory == nullptr) {
+		// the original block must stay valid when the reallocation fails
+		return nullptr;
+	}
+	std::memcpy(memory, original, std::min(size, header.size));
+	release(original);
+	return memory;
+}
+
+void *VKAPI_PTR HostAllocator::allocationFunction(void *pUserData, size_t size,
+				size_t alignment, VkSystemAllocationScope scope) {
+	return static_cast<HostAllocator *>(pUserData)->allocate(size, alignment, scope);
+}
+
+void *VKAPI_PTR HostAllocator::reallocationFunction(void *pUserData, void *pOriginal,
+				size_t size, size_t alignment, VkSystemAllocationScope scope) {
+	return static_cast<HostAllocator *>(pUserData)->reallocate(pOriginal, size, alignment, scope);
+}
+
+void VKAPI_PTR HostAllocator::freeFunction(void *pUserData, void *pMemory) {
+	static_cast<HostAllocator *>(pUserData)->release(pMemory);
+}
+
+void VKAPI_PTR HostAllocator::internalAllocationNotification(void *pUserData, size_t size,
+				VkInternalAllocationType, VkSystemAllocationScope scope) {
+	HostAllocator *HA = static_cast<HostAllocator *>(pUserData);
+	std::lock_guard<std::mutex> guard(HA->lock);
+	HA->counters.internalAllocations[(int)scope]++;
+	HA->counters.internalBytes[(int)scope] += size;
+}
+
+void VKAPI_PTR HostAllocator::internalFreeNotification(void *, size_t,
+				VkInternalAllocationType, VkSystemAllocationScope) {
+}
+
+HostAllocationCounters HostAllocator::getCounters() {
+	std::lock_guard<std::mutex> guard(lock);
+	return counters;
+}
+
+HostAllocationCounters HostAllocator::addSection(const std::string &name,
+												 const HostAllocationCounters &start) {
+	std::lock_guard<std::mutex> guard(lock);
+	HostAllocationCounters delta;
+	for(int i = 0; i < HostAllocationCounters::scopeCount; i++) {
+		delta.allocations[i] = counters.allocations[i] - start.allocations[i];
+		delta.bytes[i] = counters.bytes[i] - start.bytes[i];
+		delta.internalAllocations[i] = counters.internalAllocations[i] - start.internalAllocations[i];
+		delta.internalBytes[i] = counters.internalBytes[i] - start.internalBytes[i];
+	}
+	HostAllocationSection &S = sections[name];
+	S.runs++;
+	for(int i = 0; i < HostAllocationCounters::scopeCount; i++) {
+		S.counters.allocations[i] += delta.allocations[i];
+		S.counters.bytes[i] += delta.bytes[i];
+		S.counters.internalAllocations[i] += delta.internalAllocations[i];
+		S.counters.internalBytes[i] += delta.internalBytes[i];
+	}
+	return delta;
+}
+
+void HostAllocator::printStats() {
+	std::lock_guard<std::mutex> guard(lock);
+	std::cout << "Host allocations: " << counters.totalAllocations() << " ("
+			  << pooledAllocations << " recycled), peak " << peakBytes << " bytes\n";
+	for(int i = 0; i < HostAllocationCounters::scopeCount; i++) {
+		if(counters.allocations[i] + counters.internalAllocations[i] > 0) {
+			std::cout << "  " << scopeNames[i] << ": " << counters.allocations[i]
+					  << " allocations, " << counters.bytes[i] << " bytes, "
+					  << liveBytes[i] << " bytes alive";
+			if(counters.internalAllocations[i] > 0) {
+				std::cout << ", internal " << counters.internalAllocations[i] << " / "
+						  << counters.internalBytes[i] << " bytes";
+			}
+			std::cout << "\n";
+		}
+	}
+	for(auto &S : sections) {
+		std::cout << "  " << S.first << " (" << S.second.runs << " runs): "
+				  << S.second.counters.totalAllocations() << " allocations, "
+				  << S.second.counters.totalBytes() << " bytes\n";
+	}
+}
+
+#endif
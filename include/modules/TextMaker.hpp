@@ -2640,15 +2640,13 @@ void TextMaker::init(BaseProject *_BP, int sW, int sH, int so) {
 	createTextPipeline();
 
 //		RP.init(BP);
+	RP.name = "Text RenderPass";
 	RP.init(BP, sW, sH, -1,
 				RenderPass::getStandardAttchmentsProperties(AT_SURFACE_NOAA_DEPTH, BP));
 	RP.properties[0].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	RP.properties[1].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 
 	T.init(BP, fnt.textureFile);
-	
-	BP->DPSZs.texturesInPool += 2;	// Since text can be written before the old is released
-	BP->DPSZs.setsInPool += 2;		// we need twice the descriptors (old + new)
 }
 
 void TextMaker::resizeScreen(int sW, int sH) {
@@ -2780,6 +2778,7 @@ void TextMaker::createTextMesh() {
 		}
 		Blk.len = ib - Blk.start;
 	}
+	M->hostVisible = true;
 	M->initMesh(BP, &VD, false);
 	
 /*std::cout << "[Text] Vertices: " << (M->vertices.size()/VD.Bindings[0].stride)
@@ -2822,6 +2821,7 @@ void TextMaker::populateCommandBufferAccess(VkCommandBuffer commandBuffer, int c
 // This is the real place where the Command Buffer is written
 void TextMaker::populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
 //std::cout << "Populating for image: " << currentImage << "\n";
+	int profScope = BP->gpuProfiler.beginScope(commandBuffer, currentImage, "Text");
 	RP.begin(commandBuffer, currentImage);
 	P.bind(commandBuffer);
 	M->bind(commandBuffer);
@@ -2847,6 +2847,7 @@ void TextMaker::populateCommandBuffer(VkCommandBuffer commandBuffer, int current
 						static_cast<uint32_t>(Blk.second.start), 0, 0);
 	}
 	RP.end(commandBuffer);			
+	BP->gpuProfiler.endScope(commandBuffer, currentImage, profScope);
 }
 
 void TextMaker::freeCommandBuffer(void *Params) {
@@ -2858,6 +2859,7 @@ void TextMaker::freeCommandBuffer(void *Params) {
 
 void TextMaker::updateCommandBuffer() {
 	if(commandBufferMustUpdate) {
+		HostAllocationCounters hostStart = BP->hostAllocator.getCounters();
 //std::cout << "Creating text mesh\n";
 		createTextMesh();	// creates the new mesh
 		
@@ -2869,6 +2871,7 @@ void TextMaker::updateCommandBuffer() {
 							TextMaker::populateCommandBufferAccess,tm,
 							TextMaker::freeCommandBuffer);
 //std::cout << "Submitted\n";							
+		BP->hostAllocator.addSection("text updates", hostStart);
 		commandBufferMustUpdate = false;
 	}
 }
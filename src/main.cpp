@@ -58,6 +58,24 @@ struct skyBoxUniformBufferObject {
 	alignas(16) glm::mat4 mvpMat;
 };
 
+// Input collected by the render thread for one step of the simulation
+struct SimInput {
+	float deltaT;
+	glm::vec3 m;
+	glm::vec3 r;
+	bool fire;
+	bool nextAnim;
+};
+
+// State produced by the simulation thread, consumed by updateUniformBuffer()
+struct SimSnapshot {
+	glm::mat4 View;
+	glm::vec3 cameraPos;
+	glm::vec3 playerPos;
+	int nBones;
+	glm::mat4 bones[65];
+};
+
 
 
 
@@ -100,8 +118,14 @@ class E09 : public BaseProject {
 	Animations Anim[N_ANIMATIONS];//////
 	SkeletalAnimation SKA;//////
 
+	public:
+	// when set, localInit() times the glTF vertex interleaving on this file
+	std::string meshBenchmarkFile;
+	protected:
+	
 	// to provide textual feedback
 	TextMaker txt;
+	bool showFrameTimes = false;	// toggled with F1
 	
 	// Other application parameters
 	float Ar;	// Aspect ratio
@@ -115,6 +139,18 @@ class E09 : public BaseProject {
 	float Roll = glm::radians(0.0f);
 	
 	glm::vec4 debug1 = glm::vec4(0);
+	
+	// Game logic and animations run on their own thread
+	std::thread simThread;
+	std::atomic<bool> simRunning{false};
+	SPSCQueue<SimInput, 64> simInputs;
+	// wakes the simulation thread when an input arrives, or when it must stop
+	std::mutex simLock;
+	std::condition_variable simWake;
+	SnapshotBuffer<SimSnapshot> simState;
+	// replayed and headless runs step the simulation on the render thread,
+	// so that frame N always shows the state after input N
+	bool simInline = false;
 
 	// Here you set the main application parameters
 	void setWindowParameters() {
@@ -202,6 +238,9 @@ class E09 : public BaseProject {
 					{0, 4, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(VertexChar, weights),
 				         sizeof(glm::vec4), JOINTWEIGHT}
 				});
+		if(!meshBenchmarkFile.empty()) {
+			Model::benchmarkGLTFMesh(meshBenchmarkFile, &VDchar);
+		}
 
 
 		// Vertex Descriptor
@@ -246,6 +285,8 @@ class E09 : public BaseProject {
 		RP.init(this);
 		// sets the blue sky
 		RP.properties[0].clearValue = {0.0f,0.9f,1.0f,1.0f};
+		// the scene is recorded in parallel, in secondary command buffers
+		RP.secondaryContents = true;
 		
 
 		// Pipelines [Shader couples]
@@ -306,12 +347,11 @@ class E09 : public BaseProject {
 		// Models, textures and Descriptors (values assigned to the uniforms)
 		// MTV01.init(this, &VDsimp, "assets/models/M_TV_01.mgcg", MGCG);///
 		// TTV01.init(this, "assets/textures/T_TV_01.PNG");///
-		// sets the size of the Descriptor Set Pool
-		DPSZs.uniformBlocksInPool = 4;///
-		DPSZs.texturesInPool = 3;///
-		DPSZs.setsInPool = 4;///
 		
 std::cout << "\nLoading the scene\n\n";
+		SC.mergeGeometry = true;
+		// set 0 (the global uniforms) is the same for all the instances
+		SC.SharedDSLs = {&DSLglobal};
 		if(SC.init(this, /*Npasses*/1, VDRs, PRs, "assets/models/scene.json") != 0) {
 			std::cout << "ERROR LOADING THE SCENE\n";
 			exit(0);
@@ -341,6 +381,15 @@ std::cout << "\nLoading the scene\n\n";
 		  //TAL_RIGHT, TRH_RIGHT, TRV_BOTTOM,
 		 // {1.0f,0.0f,0.0f,1.0f}, {0.8f,0.8f,0.0f,1.0f});
 
+		// publishes the initial state, and starts the simulation
+		SimInput in0{};
+		simStep(in0, simState.beginWrite());
+		simState.publish();
+		simInline = (inputMode == ICM_REPLAY) || headless;
+		if(!simInline) {
+			simRunning = true;
+			simThread = std::thread(&E09::simLoop, this);
+		}
 	}
 	
 	// Here you create your pipelines and Descriptor Sets!
@@ -375,6 +424,15 @@ std::cout << "\nLoading the scene\n\n";
 	// Here you destroy all the Models, Texture and Desc. Set Layouts you created!
 	// You also have to destroy the pipelines
 	void localCleanup() {
+		{
+			std::lock_guard<std::mutex> guard(simLock);
+			simRunning = false;
+		}
+		simWake.notify_one();
+		if(simThread.joinable()) {
+			simThread.join();
+		}
+		
 		DSLlocalChar.cleanup();
 		DSLlocalSimp.cleanup();
 		DSLlocalPBR.cleanup();
@@ -412,7 +470,7 @@ std::cout << "\nLoading the scene\n\n";
 		// begin standard pass
 		RP.begin(commandBuffer, currentImage);
 
-		SC.populateCommandBuffer(commandBuffer, 0, currentImage);//////
+		SC.populateCommandBuffer(commandBuffer, 0, currentImage, &RP);//////
 
 		// MTV01.bind(commandBuffer);///
 		// DSTV01.bind(commandBuffer, PsimpObj, 1, currentImage);///
@@ -429,12 +487,12 @@ std::cout << "\nLoading the scene\n\n";
 		static int curDebounce = 0;
 		
 		// handle the ESC key to exit the app
-		if(glfwGetKey(window, GLFW_KEY_ESCAPE)) {
+		if(getKey(GLFW_KEY_ESCAPE)) {
 			glfwSetWindowShouldClose(window, GL_TRUE);
 		}
 
 
-		if(glfwGetKey(window, GLFW_KEY_1)) {
+		if(getKey(GLFW_KEY_1)) {
 			if(!debounce) {
 				debounce = true;
 				curDebounce = GLFW_KEY_1;
@@ -448,7 +506,7 @@ std::cout << "\nLoading the scene\n\n";
 			}
 		}
 
-		if(glfwGetKey(window, GLFW_KEY_2)) {
+		if(getKey(GLFW_KEY_2)) {
 			if(!debounce) {
 				debounce = true;
 				curDebounce = GLFW_KEY_2;
@@ -462,7 +520,7 @@ std::cout << "\nLoading the scene\n\n";
 			}
 		}
 
-		if(glfwGetKey(window, GLFW_KEY_P)) {
+		if(getKey(GLFW_KEY_P)) {
 			if(!debounce) {
 				debounce = true;
 				curDebounce = GLFW_KEY_P;
@@ -477,7 +535,7 @@ std::cout << "Showing bone index: " << debug1.z << "\n";
 			}
 		}
 
-		if(glfwGetKey(window, GLFW_KEY_O)) {
+		if(getKey(GLFW_KEY_O)) {
 			if(!debounce) {
 				debounce = true;
 				curDebounce = GLFW_KEY_O;
@@ -492,15 +550,31 @@ std::cout << "Showing bone index: " << debug1.z << "\n";
 			}
 		}
 
-		static int curAnim = 0;
-		if(glfwGetKey(window, GLFW_KEY_SPACE)) {
+		// shows or hides the CPU frame times
+		if(getKey(GLFW_KEY_F1)) {
+			if(!debounce) {
+				debounce = true;
+				curDebounce = GLFW_KEY_F1;
+
+				showFrameTimes = !showFrameTimes;
+				if(!showFrameTimes) {
+					txt.removeText(3);
+				}
+			}
+		} else {
+			if((curDebounce == GLFW_KEY_F1) && debounce) {
+				debounce = false;
+				curDebounce = 0;
+			}
+		}
+
+		SimInput in{};
+		if(getKey(GLFW_KEY_SPACE)) {
 			if(!debounce) {
 				debounce = true;
 				curDebounce = GLFW_KEY_SPACE;
 
-				curAnim = (curAnim + 1) % 5;
-				AB.Start(curAnim, 0.5);
-std::cout << "Playing anim: " << curAnim << "\n";
+				in.nextAnim = true;
 			}
 		} else {
 			if((curDebounce == GLFW_KEY_SPACE) && debounce) {
@@ -509,12 +583,34 @@ std::cout << "Playing anim: " << curAnim << "\n";
 			}
 		}
 
-		// moves the view
-		float deltaT = GameLogic();
+		// sends the input to the simulation thread: no input is ever dropped,
+		// if the queue is full the render thread waits for the simulation
+		getSixAxis(in.deltaT, in.m, in.r, in.fire);
+		float deltaT = in.deltaT;
+		if(simInline) {
+			simStep(in, simState.beginWrite());
+			simState.publish();
+		} else {
+			while(!simInputs.push(in)) {
+				std::this_thread::yield();
+			}
+			// taking the lock orders the push before a waiting predicate check
+			{
+				std::lock_guard<std::mutex> guard(simLock);
+			}
+			simWake.notify_one();
+		}
 		
-		// updated the animation
-		const float SpeedUpAnimFact = 0.85f;
-		AB.Advance(deltaT * SpeedUpAnimFact);
+		// takes the most recent state of the simulation
+		const SimSnapshot &S = simState.read();
+		
+		// Camera FOV-y, Near Plane and Far Plane
+		const float FOVy = glm::radians(45.0f);
+		const float nearPlane = 0.1f;
+		const float farPlane = 100.f;
+		glm::mat4 Prj = glm::perspective(FOVy, Ar, nearPlane, farPlane);
+		Prj[1][1] *= -1;
+		ViewPrj = Prj * S.View;
 		
 		// defines the global parameters for the uniform
 		const glm::mat4 lightView = glm::rotate(glm::mat4(1), glm::radians(-30.0f), glm::vec3(0.0f,1.0f,0.0f)) * glm::rotate(glm::mat4(1), glm::radians(-45.0f), glm::vec3(1.0f,0.0f,0.0f));
@@ -524,69 +620,69 @@ std::cout << "Playing anim: " << curAnim << "\n";
 
 		gubo.lightDir = lightDir;
 		gubo.lightColor = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
-		gubo.eyePos = cameraPos;
+		gubo.eyePos = S.cameraPos;
 
-		// defines the local parameters for the uniforms
-		UniformBufferObjectChar uboc{};	
-		uboc.debug1 = debug1;
-
-		SKA.Sample(AB);
-		std::vector<glm::mat4> *TMsp = SKA.getTransformMatrices();
-		
-//printMat4("TF[55]", (*TMsp)[55]);
+//printMat4("TF[55]", S.bones[55]);
 		
 		glm::mat4 AdaptMat =
 			glm::scale(glm::mat4(1.0f), glm::vec3(0.01f)) * 
 			glm::rotate(glm::mat4(1.0f), glm::radians(90.0f), glm::vec3(1.0f,0.0f,0.0f));
 		
+		// the uniforms are written in place, in the persistently mapped
+		// buffers of the descriptor sets: values are computed in local
+		// variables, since the mapped memory should not be read back
+		DescriptorSet *DSglobal = SC.getSharedDescriptorSet(&DSLglobal);
+		if(DSglobal != nullptr) {
+			*DSglobal->get<GlobalUniformBufferObject>(currentImage) = gubo; // Set 0, shared by all
+		}
+
 		int instanceId;//////
 		// character
 		for(instanceId = 0; instanceId < SC.TI[0].InstanceCount; instanceId++) {
-			for(int im = 0; im < TMsp->size(); im++) {
-				uboc.mMat[im]   = AdaptMat * (*TMsp)[im];
-				uboc.mvpMat[im] = ViewPrj * uboc.mMat[im];
-				uboc.nMat[im] = glm::inverse(glm::transpose(uboc.mMat[im]));
+			UniformBufferObjectChar *uboc =
+				SC.TI[0].I[instanceId].DS[0][1]->get<UniformBufferObjectChar>(currentImage); // Set 1
+			uboc->debug1 = debug1;
+			for(int im = 0; im < S.nBones; im++) {
+				glm::mat4 mMat = AdaptMat * S.bones[im];
+				uboc->mMat[im]   = mMat;
+				uboc->mvpMat[im] = ViewPrj * mMat;
+				uboc->nMat[im] = glm::inverse(glm::transpose(mMat));
 //std::cout << im << "\t";
-//printMat4("mMat", ubo.mMat[im]);
+//printMat4("mMat", mMat);
 			}
-
-			SC.TI[0].I[instanceId].DS[0][0]->map(currentImage, &gubo, 0); // Set 0
-			SC.TI[0].I[instanceId].DS[0][1]->map(currentImage, &uboc, 0);  // Set 1
 		}
 
-		UniformBufferObjectSimp ubos{};	
 		// normal objects
 		for(instanceId = 0; instanceId < SC.TI[1].InstanceCount; instanceId++) {
-			ubos.mMat   = SC.TI[1].I[instanceId].Wm;
-			ubos.mvpMat = ViewPrj * ubos.mMat;
-			ubos.nMat   = glm::inverse(glm::transpose(ubos.mMat));
-
-			SC.TI[1].I[instanceId].DS[0][0]->map(currentImage, &gubo, 0); // Set 0
-			SC.TI[1].I[instanceId].DS[0][1]->map(currentImage, &ubos, 0);  // Set 1
+			UniformBufferObjectSimp *ubos =
+				SC.TI[1].I[instanceId].DS[0][1]->get<UniformBufferObjectSimp>(currentImage); // Set 1
+			const glm::mat4 &mMat = SC.TI[1].I[instanceId].Wm;
+			ubos->mMat   = mMat;
+			ubos->mvpMat = ViewPrj * mMat;
+			ubos->nMat   = glm::inverse(glm::transpose(mMat));
 		}
 		
 		// skybox pipeline
-		skyBoxUniformBufferObject sbubo{};
-		sbubo.mvpMat = ViewPrj * glm::translate(glm::mat4(1), cameraPos) * glm::scale(glm::mat4(1), glm::vec3(100.0f));
-		SC.TI[2].I[0].DS[0][0]->map(currentImage, &sbubo, 0);
+		SC.TI[2].I[0].DS[0][0]->get<skyBoxUniformBufferObject>(currentImage)->mvpMat =
+			ViewPrj * glm::translate(glm::mat4(1), S.cameraPos) * glm::scale(glm::mat4(1), glm::vec3(100.0f));
 
 		// PBR objects
 		for(instanceId = 0; instanceId < SC.TI[3].InstanceCount; instanceId++) {
-			ubos.mMat   = SC.TI[3].I[instanceId].Wm;
-			ubos.mvpMat = ViewPrj * ubos.mMat;
-			ubos.nMat   = glm::inverse(glm::transpose(ubos.mMat));
-
-			SC.TI[3].I[instanceId].DS[0][0]->map(currentImage, &gubo, 0); // Set 0
-			SC.TI[3].I[instanceId].DS[0][1]->map(currentImage, &ubos, 0);  // Set 1
+			UniformBufferObjectSimp *ubos =
+				SC.TI[3].I[instanceId].DS[0][1]->get<UniformBufferObjectSimp>(currentImage); // Set 1
+			const glm::mat4 &mMat = SC.TI[3].I[instanceId].Wm;
+			ubos->mMat   = mMat;
+			ubos->mvpMat = ViewPrj * mMat;
+			ubos->nMat   = glm::inverse(glm::transpose(mMat));
 		}
 
 
 		// show the current position
 		std::ostringstream posText;
 		posText << "Pos: ("
-				<< playerPos.x << ", "
-				<< playerPos.y << ", "
-				<< playerPos.z << ")";
+				<< S.playerPos.x << ", "
+				<< S.playerPos.y << ", "
+				<< S.playerPos.z << ")";
 
 		txt.print(1.0f, 0.0f, posText.str(), 2, "CO", false, false, true,
 			  TAL_RIGHT, TRH_RIGHT, TRV_TOP,
@@ -607,6 +703,12 @@ std::cout << "Playing anim: " << curAnim << "\n";
 
 			//txt.print(1.0f, 1.0f, oss.str(), 1, "CO", false, false, true,TAL_RIGHT,TRH_RIGHT,TRV_BOTTOM,{1.0f,0.0f,0.0f,1.0f},{0.8f,0.8f,0.0f,1.0f});
 			
+			if(showFrameTimes) {
+				txt.print(-1.0f, 1.0f, frameTimer.getReport(), 3, "CO", false, false, true,
+					  TAL_LEFT, TRH_LEFT, TRV_BOTTOM,
+					  {1.0f, 1.0f, 0.0f, 1.0f}, {0, 0, 0, 1});
+			}
+			
 			elapsedT = 0.0f;
 		    countedFrames = 0;
 		}
@@ -614,12 +716,47 @@ std::cout << "Playing anim: " << curAnim << "\n";
 		txt.updateCommandBuffer();
 	}
 	
-	float GameLogic() {
+	// Body of the simulation thread: one step for each frame of input
+	void simLoop() {
+		while(true) {
+			SimInput in;
+			{
+				std::unique_lock<std::mutex> guard(simLock);
+				simWake.wait(guard, [&]() {return !simRunning || simInputs.pop(in);});
+				if(!simRunning) {
+					return;
+				}
+			}
+			simStep(in, simState.beginWrite());
+			simState.publish();
+		}
+	}
+	
+	void simStep(const SimInput &in, SimSnapshot &S) {
+		static int curAnim = 0;
+		if(in.nextAnim) {
+			curAnim = (curAnim + 1) % 5;
+			AB.Start(curAnim, 0.5);
+std::cout << "Playing anim: " << curAnim << "\n";
+		}
+
+		// moves the view
+		GameLogic(in, S);
+		
+		// updated the animation
+		const float SpeedUpAnimFact = 0.85f;
+		AB.Advance(in.deltaT * SpeedUpAnimFact);
+		
+		SKA.Sample(AB);
+		std::vector<glm::mat4> *TMsp = SKA.getTransformMatrices();
+		S.nBones = std::min((int)TMsp->size(), 65);
+		for(int im = 0; im < S.nBones; im++) {
+			S.bones[im] = (*TMsp)[im];
+		}
+	}
+	
+	void GameLogic(const SimInput &in, SimSnapshot &S) {
 		// Parameters
-		// Camera FOV-y, Near Plane and Far Plane
-		const float FOVy = glm::radians(45.0f);
-		const float nearPlane = 0.1f;
-		const float farPlane = 100.f;
 		// Player starting point
 		const glm::vec3 StartingPosition = glm::vec3(0.0, 0.0, 5);
 		// Camera target height and distance
@@ -637,10 +774,10 @@ std::cout << "Playing anim: " << curAnim << "\n";
 		const float MIN_CAM_DIST =  1.5;
 
 		// Integration with the timers and the controllers
-		float deltaT;
-		glm::vec3 m = glm::vec3(0.0f), r = glm::vec3(0.0f);
-		bool fire = false;
-		getSixAxis(deltaT, m, r, fire);
+		// (collected by updateUniformBuffer() on the render thread)
+		float deltaT = in.deltaT;
+		glm::vec3 m = in.m, r = in.r;
+		bool fire = in.fire;
 		float MOVE_SPEED = fire ? MOVE_SPEED_RUN : MOVE_SPEED_BASE;
 
 
@@ -656,7 +793,6 @@ std::cout << "Playing anim: " << curAnim << "\n";
 		camDist = (MIN_CAM_DIST + MIN_CAM_DIST) / 2.0f; 
 
 		// To be done in the assignment
-		ViewPrj = glm::mat4(1);
 		World = glm::mat4(1);
 
 
@@ -697,9 +833,7 @@ std::cout << "Playing anim: " << curAnim << "\n";
 		// Final world matrix computaiton
 		World = glm::translate(glm::mat4(1), playerPos) * glm::rotate(glm::mat4(1.0f), dampedRelDir, glm::vec3(0,1,0));
 		
-		// Projection
-		glm::mat4 Prj = glm::perspective(FOVy, Ar, nearPlane, farPlane);
-		Prj[1][1] *= -1;
+		// Projection: done by the render thread, that owns the aspect ratio
 
 		// View
 		// Target
@@ -713,9 +847,11 @@ std::cout << "Playing anim: " << curAnim << "\n";
 
 		glm::mat4 View = glm::lookAt(dampedCamPos, target, glm::vec3(0,1,0));
 
-		ViewPrj = Prj * View;
+		S.View = View;
+		S.cameraPos = cameraPos;
+		S.playerPos = playerPos;
 		
-		float vel = length(playerPos - oldPos) / deltaT;
+		float vel = deltaT > 0.0f ? length(playerPos - oldPos) / deltaT : 0.0f;
 		
 		if(vel < 0.2) {
 			if(currRunState != 1) {
@@ -730,18 +866,60 @@ std::cout << "Playing anim: " << curAnim << "\n";
 				currRunState = 3;
 			}
 		}
-		
-		return deltaT;
 	}
 };
 
 
 // This is the main: probably you do not need to touch this!
-int main() {
+int main(int argc, char **argv) {
     E09 app;
 
+	// --headless N renders N frames offscreen, without opening a window
+	// --record F saves the user input to file F
+	// --replay F plays back the input in F with a fixed time step,
+	//            and reports the frame time percentiles
+	// --gpu-profile F times render passes and techniques on the GPU,
+	//                 and writes a Chrome trace to F
+	// --frames-in-flight N uses N (1 to 4) frames in flight
+	// --present-mode M selects fifo, mailbox or immediate presentation
+	// --swapchain-images N asks for N swap chain images
+	// --bench-cb 1 measures the per-frame cost of the named command buffers
+	// --bench-mesh F times the vertex interleaving of the glTF file F
+	//                (e.g. --bench-mesh assets/models/uomo.gltf)
+	int headlessFrames = 0;
+	for(int i = 1; i < argc - 1; i++) {
+		if(strcmp(argv[i], "--headless") == 0) {
+			headlessFrames = atoi(argv[i + 1]);
+		} else if(strcmp(argv[i], "--record") == 0) {
+			app.recordInput(argv[i + 1]);
+		} else if(strcmp(argv[i], "--replay") == 0) {
+			app.replayInput(argv[i + 1]);
+		} else if(strcmp(argv[i], "--gpu-profile") == 0) {
+			app.gpuProfiler.enabled = true;
+			app.gpuProfiler.traceFile = argv[i + 1];
+		} else if(strcmp(argv[i], "--frames-in-flight") == 0) {
+			app.setFramesInFlight(atoi(argv[i + 1]));
+		} else if(strcmp(argv[i], "--present-mode") == 0) {
+			if(strcmp(argv[i + 1], "fifo") == 0) {
+				app.setPresentMode(VK_PRESENT_MODE_FIFO_KHR);
+			} else if(strcmp(argv[i + 1], "mailbox") == 0) {
+				app.setPresentMode(VK_PRESENT_MODE_MAILBOX_KHR);
+			} else if(strcmp(argv[i + 1], "immediate") == 0) {
+				app.setPresentMode(VK_PRESENT_MODE_IMMEDIATE_KHR);
+			} else {
+				std::cout << "Unknown present mode: " << argv[i + 1] << "\n";
+			}
+		} else if(strcmp(argv[i], "--swapchain-images") == 0) {
+			app.setSwapChainImageCount(atoi(argv[i + 1]));
+		} else if(strcmp(argv[i], "--bench-cb") == 0) {
+			app.commandBufferBenchmark = atoi(argv[i + 1]) != 0;
+		} else if(strcmp(argv[i], "--bench-mesh") == 0) {
+			app.meshBenchmarkFile = argv[i + 1];
+		}
+	}
+
     try {
-        app.run();
+        app.run(headlessFrames);
     } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
         return EXIT_FAILURE;